@@ -1,10 +1,12 @@
 // Haptic
+#define _GNU_SOURCE		/* CPU affinity */
 #include <stdlib.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_haptic.h>
 #include <SDL2/SDL_net.h>
 
 #include <stdio.h>		/* printf */
+#include <stddef.h>		/* offsetof */
 #include <string.h>		/* strstr */
 #include <ctype.h>		/* isdigit */
 
@@ -21,13 +23,50 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <stdarg.h>
+#include <sys/stat.h>		/* mkdir */
+#ifndef _WIN32
+#include <sys/socket.h>		/* Control socket */
+#include <sys/un.h>
+#include <fcntl.h>
+#include <sched.h>		/* Real-time mode */
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#define HOMEVAR		"APPDATA"
+#else
+#define HOMEVAR		"HOME"
+#endif
 
 #define DFLTHOST        "localhost"
 #define DFLTPORT        5401
 #define MAXMSG          512
-#define fgfsclose       SDLNet_TCP_Close
+#define OUTBUF		8192	// Telnet commands collected for one send
+
+// Errors of flightgear connections, functions return them as negative values
+#define FGFS_OK		0
+#define FGFS_CLOSED	-1	// Connection closed or broken
+
+// One TCP connection to flightgear. It owns all its buffers and nothing is
+// allocated while it is used, so connections are independent of each other
+// and may each be served by a different thread.
+typedef struct __fgConn {
+	TCPsocket sock;
+	SDLNet_SocketSet set;	// Holds just sock, for waiting on it
+	char in[MAXMSG];	// Received data not yet returned as lines
+	int inlen;
+	char line[MAXMSG];	// Line returned by fgfsread()
+	char out[OUTBUF];	// Telnet commands collected between fgfsbatch() and fgfspush()
+	int outlen;
+	bool batch;
+	int error;		// First error, kept until the connection is closed
+} fgConn;
 
 #define NAMELEN		30
+#define PATHLEN		256
 
 // Currently supported effects:
 // 0) Constant force = pilot G and control surface loading
@@ -35,7 +74,17 @@
 #define TIMEOUT		1	// 1 sec
 #define READ_TIMEOUT	5	// 5 secs
 #define CONN_TIMEOUT	30	// 30 seconds
+#define TELNET_RETRY	1000	// Telnet connection retry interval in ms
+#define LOOP_PERIOD	10	// Update loop period, ms
+#define IDLE_PERIOD	50	// Longest wait of the idle loop, ms
+#define IDLE_AFTER	2000	// Unchanged samples make an instance idle after this long, ms
+#define IDLE_FROZEN	500	// The same while flightgear is paused
+#define IDLE_REFRESH	30000	// Held constant forces are restarted before they run out, ms
 #define AXES		3	// Maximum axes supported
+#define SOURCES		(3 * AXES)	// Force inputs: stick forces, pilot forces, then vibration
+#define FILTERED_SOURCES	(2 * AXES)	// Sources smoothed by the low pass filter
+#define MAX_INSTANCES	8	// Maximum flightgear instances feeding the bridge
+#define MAX_ROUTED	16	// Maximum devices routed to one instance
 
 #define CONST_X		0
 #define CONST_Y		1
@@ -43,38 +92,586 @@
 #define STICK_SHAKER	3
 #define FRICTION	4
 #define DAMPER		5
+#define GROUND_RUMBLE	6
+#define ENGINE_VIBRATION	7
+#define SPRING		8
+#define STREAM		9	// Custom effect streaming all axes, replaces constant forces
 
-#define EFFECTS		9
+#define EFFECTS		10
 
-const char axes[AXES] = { 'x', 'y', 'z' };
+const char *effect_names[EFFECTS] = {
+	"constant X", "constant Y", "constant Z", "stick shaker", "friction",
+	"damper", "ground rumble", "engine vibration", "spring", "force stream"
+};
 
-//void init_sockaddr(struct sockaddr_in *name, const char *hostname, unsigned port);
-TCPsocket fgfsconnect(const char *hostname, const int port, bool server);
-int fgfswrite(TCPsocket sock, char *msg, ...);
-const char *fgfsread(TCPsocket sock, int wait);
-void fgfsflush(TCPsocket sock);
+// Effects in order of importance, the first ones get device slots when
+// there are not enough for all of them
+const int effect_priority[EFFECTS] = {
+	STREAM, CONST_Y, CONST_X, STICK_SHAKER, SPRING, DAMPER, CONST_Z,
+	GROUND_RUMBLE, ENGINE_VIBRATION, FRICTION
+};
+
+// Force streaming. Each round uploads the next STREAM_SAMPLES ms of force
+// as a custom effect, the device plays it out at 1 kHz on its own.
+#define STREAM_SAMPLES	30	// Lookahead, covers a couple of late rounds
+#define STREAM_TOL	330	// Playing sample off by more than 1% of full scale uploads anew
+
+bool stream_output = false;
+
+// Closed loop. Spring and damper are computed here from the stick position
+// read back from the joystick, flightgear only sets stiffness and trim.
+#define LOOP_VELOCITY_TAU	20.0	// Stick velocity filter, ms
+#define LOOP_DAMPER_TIME	0.1	// Damper force at full loading, per full travel per second
+
+bool closed_loop = false;
+
+// Periodic effects are updated only when they change more than this
+#define PERIODIC_PERIOD_TOL	0.05	// Relative period change
+#define PERIODIC_LEVEL_TOL	650	// Magnitude change, 2% of full scale
 
-// Socket used to communicate with flightgear
-TCPsocket telnet_sock, server_sock, client_sock;
-SDLNet_SocketSet socketset;
+// Condition effect coefficients are updated only when they change more than this
+#define CONDITION_TOL	330	// 1% of full scale
+
+const char axes[AXES] = { 'x', 'y', 'z' };
+
+// Flightgear connection states
+#define FG_WAITING	0	// Waiting for generic IO connection
+#define FG_TELNET	1	// Generic IO connected, opening telnet
+#define FG_AIRCRAFT	2	// Telnet open, waiting for the aircraft name
+#define FG_RUNNING	3	// Both connections up
 
 // Effect struct definitions, used to store parameters
 typedef struct __effectParams {
 	float pilot[AXES];
 	float stick[AXES];
+	int reconfigure;
 	int shaker_trigger;
 	float rumble_period;	// Ground rumble period, 0=disable
+	float engine_period;	// Engine vibration period in ms, 0=disable
+	float engine_level;	// Engine vibration strength, 0 - 1
+	float control_loading;	// Dynamic pressure scaled to 0 - 1, sets spring and damper stiffness
+
+	// Raw inputs of native trim, shaker and pusher logic, angles in degrees
+	float aoa;
+	float trim[AXES];	// Force trim of aileron, elevator, rudder, -1 - 1
+	float shaker_aoa;
+	float pusher_aoa;
+	float pusher_angle;	// Pusher reaches full force this far above pusher_aoa
+
+	// Raw inputs of buffet and turbulence synthesis
+	float stall_aoa;
+	float accel_z;		// Pilot vertical acceleration, fps^2
+
+	int freeze;		// Simulation paused
+
+	// Sample timing, simulator elapsed time in seconds. Changes in idle
+	// samples too, so it is left out when samples are compared.
+	double sim_time;	// When flightgear sent the sample
+	double force_time;	// When force-feedback.nas computed the forces
+	int sequence;		// Counts force computations
+	float speed_up;		// Simulator time rate, 0 = not sent
 
 	float x;		// Forces
 	float y;
 	float z;
 } effectParams;
 
+// Generic IO layout, compiled from ff-protocol.xml by load_protocol().
+// Each chunk is decoded straight into its effectParams field.
+#define FIELD_INT	0	// Wire types of chunks
+#define FIELD_BOOL	1
+#define FIELD_FLOAT	2
+#define FIELD_DOUBLE	3
+#define FIELD_FIXED	4
+
+#define MAX_FIELDS	64
+
+typedef struct __protocolField {
+	int type;
+	int size;		// Bytes in binary mode
+	int offset;		// Target in effectParams, -1 = not used
+	int target;		// Type of the target, FIELD_INT, FIELD_FLOAT or FIELD_DOUBLE
+} protocolField;
+
+typedef struct __genericProtocol {
+	bool binary;
+	bool network_order;	// Byte order of binary records
+	char separator;		// Text mode field separator
+	int length;		// Binary record length, including footer
+	bool native;		// Carries the inputs of native trim, shaker and pusher
+	bool timed;		// Carries sample timestamps
+	int num_fields;
+	protocolField field[MAX_FIELDS];
+} genericProtocol;
+
+genericProtocol protocol;
+
+// Trim, stick shaker and stick pusher are run here instead of in Nasal,
+// when the protocol carries their inputs
+bool native_logic = true;
+
+#define AOA_HYSTERESIS	1.0	// Shaker and pusher release this far below their AoA, degrees
+
+// Sign trim takes in stick forces. force-feedback.nas adds trim to the
+// control angle and sends aileron and elevator forces negated, rudder not.
+const float trim_sign[AXES] = { -1.0, -1.0, 1.0 };
+
+// Buffet and turbulence are synthesized at the update rate of the devices
+#define BUFFET_ONSET	4.0	// Buffet builds up over this many degrees below stall AoA
+#define TURBULENCE_FULL	0.5	// Vertical acceleration change between samples for full turbulence, g
+#define TURBULENCE_DECAY	400.0	// Turbulence fades with this time constant, ms
+#define G_FPS		32.174
+
+// Noise is band limited by two low pass filters, time constants in ms.
+// Scales bring the filtered noise back to about full range.
+#define BUFFET_FAST	15.0
+#define BUFFET_SLOW	60.0
+#define BUFFET_SCALE	3.0
+#define TURBULENCE_FAST	40.0
+#define TURBULENCE_SLOW	250.0
+#define TURBULENCE_SCALE	4.0
+
+// Share of the vibration felt on aileron, elevator and rudder
+const float buffet_axes[AXES] = { 0.5, 1.0, 0.2 };
+const float turbulence_axes[AXES] = { 0.6, 1.0, 0.3 };
+
+// Properties fg-haptic understands
+const struct {
+	const char *node;
+	size_t offset;
+	int target;		// FIELD_INT, FIELD_FLOAT or FIELD_DOUBLE
+} protocol_nodes[] = {
+	{ "/haptic/reconfigure", offsetof(effectParams, reconfigure), FIELD_INT },
+	{ "/haptic/pilot/x", offsetof(effectParams, pilot[0]), FIELD_FLOAT },
+	{ "/haptic/pilot/y", offsetof(effectParams, pilot[1]), FIELD_FLOAT },
+	{ "/haptic/pilot/z", offsetof(effectParams, pilot[2]), FIELD_FLOAT },
+	{ "/haptic/stick-force/aileron", offsetof(effectParams, stick[0]), FIELD_FLOAT },
+	{ "/haptic/stick-force/elevator", offsetof(effectParams, stick[1]), FIELD_FLOAT },
+	{ "/haptic/stick-force/rudder", offsetof(effectParams, stick[2]), FIELD_FLOAT },
+	{ "/haptic/stick-shaker/trigger", offsetof(effectParams, shaker_trigger), FIELD_INT },
+	{ "/haptic/ground-rumble/period", offsetof(effectParams, rumble_period), FIELD_FLOAT },
+	{ "/haptic/engine-vibration/period", offsetof(effectParams, engine_period), FIELD_FLOAT },
+	{ "/haptic/engine-vibration/level", offsetof(effectParams, engine_level), FIELD_FLOAT },
+	{ "/haptic/control-loading/level", offsetof(effectParams, control_loading), FIELD_FLOAT },
+	{ "/orientation/alpha-deg", offsetof(effectParams, aoa), FIELD_FLOAT },
+	{ "/haptic/force-trim-aileron", offsetof(effectParams, trim[0]), FIELD_FLOAT },
+	{ "/haptic/force-trim-elevator", offsetof(effectParams, trim[1]), FIELD_FLOAT },
+	{ "/haptic/force-trim-rudder", offsetof(effectParams, trim[2]), FIELD_FLOAT },
+	{ "/haptic/aircraft-setup/stick-shaker-AoA", offsetof(effectParams, shaker_aoa), FIELD_FLOAT },
+	{ "/haptic/aircraft-setup/pusher-start-AoA", offsetof(effectParams, pusher_aoa), FIELD_FLOAT },
+	{ "/haptic/aircraft-setup/pusher-working-angle-deg", offsetof(effectParams, pusher_angle), FIELD_FLOAT },
+	{ "/haptic/aircraft-setup/stall-AoA", offsetof(effectParams, stall_aoa), FIELD_FLOAT },
+	{ "/accelerations/pilot/z-accel-fps_sec", offsetof(effectParams, accel_z), FIELD_FLOAT },
+	{ "/sim/time/elapsed-sec", offsetof(effectParams, sim_time), FIELD_DOUBLE },
+	{ "/haptic/timestamp", offsetof(effectParams, force_time), FIELD_DOUBLE },
+	{ "/haptic/sequence", offsetof(effectParams, sequence), FIELD_INT },
+	{ "/sim/freeze/master", offsetof(effectParams, freeze), FIELD_INT },
+	{ "/sim/speed-up", offsetof(effectParams, speed_up), FIELD_FLOAT },
+};
+
+#define PROTOCOL_NODES	(sizeof(protocol_nodes) / sizeof(protocol_nodes[0]))
+
+// Force prediction. Stick and pilot forces are tracked by an alpha-beta
+// filter on each input, and extrapolated to when the device applies them.
+#define PREDICT_ALPHA	0.6	// Level correction of the filter
+#define PREDICT_BETA	0.15	// Rate correction
+#define PREDICT_MAX	150	// Longest extrapolation, ms
+#define PREDICT_RESET	500	// Samples further apart restart the filter, ms
+
+typedef struct __forcePredictor {
+	bool valid;
+	unsigned int time;	// Arrival of the last sample
+	float x[FILTERED_SOURCES];	// Estimated forces at time
+	float v[FILTERED_SOURCES];	// and their rates, per second
+} forcePredictor;
+
+float predict_ms = 0.0;		// Flightgear and USB latency to make up for, 0 = off
+
+// Sample timing. Arrival time minus simulator time is the transit time plus
+// an unknown clock offset, the smallest one seen stands for the offset.
+// Samples are aged against it. Simulator time is scaled by speed-up from
+// the last rebase, which happens whenever it stops or changes rate. Without
+// the freeze flag a pause shows only as simulator time standing still, which
+// it also does between frames when generic IO runs faster than the frame
+// rate, so that counts only once it lasts PAUSE_STILL.
+#define TIMING_WINDOW	10000	// Smallest transit is looked for over two of these, ms
+#define STALE_AGE	250	// Older samples are dropped, ms
+#define PAUSE_STILL	200	// Simulator time standing still this long is a pause, ms
+#define STALE_CATCHUP	16	// Samples dropped at once while catching up
+
+typedef struct __sampleTiming {
+	bool valid;
+	double last_time;	// Simulator time of the last sample
+	int last_seq;
+	double anchor_sim;	// Simulator time at the last rebase, ms
+	unsigned int anchor_now;	// Arrival at the last rebase
+	float speed_up;
+	double still_time;	// Simulator time standing still since still_since
+	unsigned int still_since;
+	double base, window_min;	// Arrival - simulator time, smallest in last and this window, ms
+	unsigned int window_end;
+
+	// Statistics since the last report
+	unsigned int samples, stale, gaps, repeats;
+	float age_sum, age_max;	// ms
+} sampleTiming;
+
+// Reconfigure steps
+#define RECONF_IDLE	0
+#define RECONF_READING	1	// Waiting for the replies to setting gets
+#define RECONF_CONFIRM	2	// Waiting for flightgear to clear reconfigure
+
+// Types of settings read at reconfigure
+#define SETTING_FLOAT	0
+#define SETTING_USHORT	1
+#define SETTING_AXIS	2	// signed char
+#define SETTING_BOOL	3
+
+// A setting asked from flightgear, stored when its reply arrives
+typedef struct __settingGet {
+	unsigned int num;	// Device number, devices may come and go meanwhile
+	size_t offset;		// Field in hapticDevice
+	int type;
+} settingGet;
+
+// One flightgear instance with its own generic IO and telnet connections
+typedef struct __fgInstance {
+	int num;		// Instance number, for messages
+	char host[NAMELEN + 1];	// Telnet host and ports
+	int telnet_port;
+	int generic_port;
+
+	unsigned int routed[MAX_ROUTED];	// Device numbers driven by this instance
+	int num_routed;		// 0 = all devices not routed elsewhere
+
+	// Connections used to communicate with flightgear
+	fgConn telnet, generic;
+	TCPsocket server_sock;
+
+	int state;
+	bool lost;		// Set when the telnet connection can't be opened
+	unsigned int accepted, next_try;	// Telnet connection timing
+	SDL_Thread *connector;	// Opens telnet without blocking the loop
+	SDL_atomic_t connected;	// Set when connector is done
+	TCPsocket connect_sock;	// Its result, NULL if it failed
+	int announced;		// Devices FG knows about
+	char aircraft[NAMELEN + 1];	// For aircraft specific device profiles
+
+	bool reconf_request;
+	int reconf;		// Reconfigure step, replies are collected over several rounds
+	unsigned int reconf_end;	// Stop waiting for replies at this time
+	settingGet *gets;	// Settings asked, in the order of their replies
+	int num_gets, got;
+	bool warned;		// Generic IO layout mismatch reported
+	bool shaker, pusher;	// Native shaker and pusher state
+	bool accel_valid;	// accel_z holds the previous sample
+	float accel_z;
+	unsigned int accel_time;
+	float turbulence;	// Turbulence envelope, 0 - 1
+	forcePredictor predict;
+	sampleTiming timing;
+	effectParams new_params;
+
+	// Idle mode, devices hold their last force without updates
+	bool idle;
+	bool busy;		// Forces of the last round need updates even if samples don't change
+	unsigned int changed;	// Last change of the samples
+	unsigned int held;	// Constant forces last restarted
+} fgInstance;
+
+fgInstance instances[MAX_INSTANCES];
+int num_instances;
+
+// Remote force link. The device side runs as a server receiving mixed force
+// levels, so only small packets cross the network. All packets start with
+// magic, version, type and total length bytes, followed by the 16 bit
+// device number where there is one. Multi-byte fields are in network byte
+// order.
+#define REMOTE_NONE	0
+#define REMOTE_SERVER	1	// Drives local devices from received packets
+#define REMOTE_CLIENT	2	// Mixes forces for devices of a remote server
+
+#define REMOTE_MAGIC	0xFB
+#define REMOTE_VERSION	2	// 2: 16 bit device numbers
+
+#define REMOTE_HELLO	1	// Client asks for the device list
+#define REMOTE_DEVICE	2	// Server describes one device
+#define REMOTE_REMOVED	3	// Server lost a device
+#define REMOTE_FORCE	4	// Client sends forces of one device
+#define REMOTE_ECHO	5	// Server returns a force packet for latency measurement
+#define REMOTE_CONFIG	6	// Client sends device side settings of one device
+#define REMOTE_PERIODIC	7	// Client changes a periodic effect of one device
+#define REMOTE_CONDITION	8	// Client changes a condition effect coefficient of one device
+
+#define REMOTE_HEADER_LEN	4
+#define REMOTE_FORCE_LEN	20
+#define REMOTE_DEVICE_LEN	(16 + NAMELEN + 1)
+#define REMOTE_CONFIG_LEN	16
+#define REMOTE_PERIODIC_LEN	12
+#define REMOTE_CONDITION_LEN	10
+#define REMOTE_MAXPACKET	64
+
+#define REMOTE_TRIG_SHAKER	0x0001	// Force packet effect triggers
+
+#define REMOTE_TIMEOUT	1000	// Devices go neutral without forces for this long, ms
+#define REMOTE_RETRY	2000	// Client hello / reconnect interval, ms
+#define REMOTE_ECHO_EVERY	10	// Server echoes every Nth force packet
+#define REMOTE_REPORT	10000	// Link statistics interval, ms
+
+typedef struct __remoteLink {
+	int mode;
+	bool udp;		// UDP or TCP transport
+	char host[NAMELEN + 1];	// Server address, client only
+	int port;
+
+	UDPsocket udp_sock;
+	UDPpacket *packet;
+	IPaddress peer;		// UDP peer, on server side the client it's locked to
+	bool have_peer;
+	unsigned int peer_rx;	// Last packet from the peer
+
+	TCPsocket tcp_server, tcp_sock;
+	SDLNet_SocketSet socketset;
+	Uint8 buf[REMOTE_MAXPACKET];	// TCP stream reassembly
+	int buflen;
+
+	Uint16 seq;		// Sequence of sent force packets
+	unsigned int last_rx, next_try;
+
+	// Statistics
+	bool have_seq;
+	Uint16 rx_seq;
+	unsigned int packets, lost, max_gap;
+	unsigned int rtt_min, rtt_max, rtt_sum, rtt_count;
+	float rtt_avg;		// Smoothed round trip time, ms
+	unsigned int next_report;
+} remoteLink;
+
+remoteLink remote;
+
+//void init_sockaddr(struct sockaddr_in *name, const char *hostname, unsigned port);
+TCPsocket fgfsconnect(const char *hostname, const int port, bool server);
+int fgfsopen(fgConn * c, TCPsocket sock);
+void fgfsclose(fgConn * c);
+int fgfswrite(fgConn * c, char *msg, ...);
+void fgfsbatch(fgConn * c);
+int fgfspush(fgConn * c);
+int fgfssend(fgConn * c);
+const char *fgfsread(fgConn * c, int wait);
+const char *fgfsreply(fgConn * c);
+const char *fgfsreadrecord(fgConn * c, int len, int wait);
+void fgfsflush(fgConn * c);
+
+// Log ring. Messages from the update loop are formatted into a ring of
+// fixed slots and written out by a thread of their own, so a misbehaving
+// device can't stall the loop on terminal writes. Writers claim slots with
+// compare-and-swap and never wait; when the ring is full the message is
+// counted and lost. Each call site of log_msg() passes at most LOG_BURST
+// messages per LOG_WINDOW, the rest are counted and reported with the next
+// one that goes through.
+#define LOG_SLOTS	128	// Power of two, holds a device report
+#define LOG_LEN		160
+#define LOG_BURST	5
+#define LOG_WINDOW	1000	// ms
+#define LOG_DRAIN	100	// Longest wait of the log thread, ms
+
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_LEVELS };
+const char *log_levels[LOG_LEVELS] = { "error", "warn", "info", "debug" };
+
+typedef struct {
+	unsigned int window;	// Start of the rate limit window
+	int count;		// Messages in the window, races between threads only loosen the limit
+	SDL_atomic_t suppressed;
+} logSite;
+
+struct {
+	struct {
+		SDL_atomic_t ready;	// Text complete, for the log thread to write
+		char text[LOG_LEN];
+	} ring[LOG_SLOTS];
+	SDL_atomic_t head, tail;	// Next slot to claim, next to write out
+	SDL_atomic_t level;	// Most verbose level written
+	SDL_atomic_t lost, written, suppressed;
+	SDL_atomic_t stop;
+	SDL_sem *wake;
+	SDL_Thread *thread;
+	bool loop;		// Update loop running, device reports go through the log too
+
+	// Profiles saved by the loop, for the log thread to write
+	SDL_mutex *profile_lock;
+	struct __profileWrite *profiles, *profiles_last;
+} logger = { .level = { LOG_INFO } };
+
+void write_profiles(void);
+
+#define log_msg(level, ...) do { static logSite log_site_; log_write(&log_site_, level, __VA_ARGS__); } while (0)
+
+void log_write(logSite * site, int level, const char *fmt, ...)
+{
+	unsigned int now = SDL_GetTicks();
+	int head, len, suppressed;
+	va_list vl;
+	char *text;
+
+	if (level > SDL_AtomicGet(&logger.level))
+		return;
+
+	// Startup messages go straight out, in order with the rest of its output
+	if (!logger.loop) {
+		va_start(vl, fmt);
+		vprintf(fmt, vl);
+		va_end(vl);
+		putchar('\n');
+		return;
+	}
+
+	// Reports of many lines come without a site and are not limited
+	if (site && now - site->window >= LOG_WINDOW) {
+		site->window = now;
+		site->count = 0;
+	}
+	if (site && ++site->count > LOG_BURST) {
+		SDL_AtomicAdd(&site->suppressed, 1);
+		SDL_AtomicAdd(&logger.suppressed, 1);
+		return;
+	}
+
+	do {
+		head = SDL_AtomicGet(&logger.head);
+		if ((unsigned int)(head - SDL_AtomicGet(&logger.tail)) >= LOG_SLOTS) {
+			SDL_AtomicAdd(&logger.lost, 1);
+			return;
+		}
+	} while (!SDL_AtomicCAS(&logger.head, head, head + 1));
+
+	text = logger.ring[head & (LOG_SLOTS - 1)].text;
+	va_start(vl, fmt);
+	len = vsnprintf(text, LOG_LEN, fmt, vl);
+	va_end(vl);
+	if (len < 0)
+		len = 0;
+	if (site && (suppressed = SDL_AtomicSet(&site->suppressed, 0)) > 0 && len < LOG_LEN)
+		snprintf(text + len, LOG_LEN - len, " (%d more suppressed)", suppressed);
+
+	SDL_AtomicSet(&logger.ring[head & (LOG_SLOTS - 1)].ready, 1);
+	if (logger.wake)
+		SDL_SemPost(logger.wake);
+}
+
+/*
+ * Writes out complete messages in order. Only the log thread calls this
+ * while it runs.
+ */
+void log_drain(void)
+{
+	int tail, lost;
+
+	while ((tail = SDL_AtomicGet(&logger.tail)) != SDL_AtomicGet(&logger.head)) {
+		SDL_atomic_t *ready = &logger.ring[tail & (LOG_SLOTS - 1)].ready;
+
+		if (!SDL_AtomicGet(ready))
+			break;	// Still being written
+		puts(logger.ring[tail & (LOG_SLOTS - 1)].text);
+		SDL_AtomicSet(ready, 0);
+		SDL_AtomicSet(&logger.tail, tail + 1);
+		SDL_AtomicAdd(&logger.written, 1);
+	}
+	if ((lost = SDL_AtomicSet(&logger.lost, 0)) > 0)
+		printf("Log full, %d messages lost\n", lost);
+	fflush(stdout);
+}
+
+int log_thread(void *data)
+{
+#ifndef _WIN32
+	sigset_t signals;
+
+	// Signals go to the update loop, which stops this thread on the way out
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+#endif
+	while (!SDL_AtomicGet(&logger.stop)) {
+		SDL_SemWaitTimeout(logger.wake, LOG_DRAIN);
+		log_drain();
+		write_profiles();
+	}
+	return 0;
+}
+
+void init_log(void)
+{
+	logger.profile_lock = SDL_CreateMutex();
+	logger.wake = SDL_CreateSemaphore(0);
+	if (logger.wake)
+		logger.thread = SDL_CreateThread(log_thread, "fg-haptic log", NULL);
+	if (!logger.thread)
+		printf("Unable to start log thread: %s, loop messages are written at exit\n", SDL_GetError());
+}
+
+/*
+ * Stops the log thread and writes out what is left.
+ */
+void close_log(void)
+{
+	if (logger.thread) {
+		SDL_AtomicSet(&logger.stop, 1);
+		SDL_SemPost(logger.wake);
+		SDL_WaitThread(logger.thread, NULL);
+		logger.thread = NULL;
+	}
+	write_profiles();
+	log_drain();
+	if (logger.wake)
+		SDL_DestroySemaphore(logger.wake);
+	logger.wake = NULL;
+	if (logger.profile_lock)
+		SDL_DestroyMutex(logger.profile_lock);
+	logger.profile_lock = NULL;
+}
+
+int log_level(const char *name)
+{
+	for (int l = 0; l < LOG_LEVELS; l++)
+		if (strcmp(name, log_levels[l]) == 0)
+			return l;
+	return -1;
+}
+
 int num_devices;
 
+// Characterization of a device by --benchmark, kept in its profile.
+// Latencies are of one SDL_HapticUpdateEffect call, in us: median, 95th
+// and 99th percentile and worst.
+typedef struct {
+	float rate;		// Sustained updates per second, 0 = not measured
+	float running[4];	// Latency with the effect playing
+	float stopped[4];	// Latency with the effect stopped
+	int stops;		// Percent of updates that stopped a playing effect, -1 = unknown
+	int slots;		// Effects the device really takes, 0 = not measured
+} benchResults;
+
+// Mixed force levels handed from the update loop to the output thread
+typedef struct __forceFrame {
+	float x, y, z;
+	bool shaker;
+	bool active;		// false = the loop holds the device, nothing to send
+} forceFrame;
+
+// Double buffer with one writer, the latest frame is frame[seq & 1]
+typedef struct __forceBuffer {
+	forceFrame frame[2];
+	SDL_atomic_t seq;	// Frames written
+} forceBuffer;
+
 typedef struct __hapticdevice {
 	SDL_Haptic *device;
+	SDL_Joystick *joystick;	// Joystick the haptic device belongs to
+	SDL_JoystickID instance;	// Identifies the device in hot-plug events
+	fgInstance *fg;		// Flightgear instance driving this device, NULL = none
+	bool remote;		// Device is on a remote force server
 	char name[NAMELEN + 1];	// Name
+	char guid[33];		// Joystick GUID, identifies the device profile
+	int guid_index;		// Among open devices of the same GUID, identical models share it
 	unsigned int num;	// Num of this device
 	unsigned int supported;	// Capabilities
 	unsigned int axes;	// Count of axes
@@ -97,433 +694,3829 @@ typedef struct __hapticdevice {
 	float stick_gain;
 	float shaker_gain;
 	float rumble_gain;
+	float engine_gain;
+	float spring_gain;	// Condition effect coefficients at full control loading
+	float damper_gain;
+	float friction_gain;
+	float buffet_gain;
+	float turbulence_gain;
 
-	// TODO: Possibility to invert axes
 	signed char pilot_axes[AXES];	// Axes mapping, -1 = not used
 	signed char stick_axes[AXES];
-
-	unsigned int last_rumble;
+	bool invert[AXES];	// Reverse the force on a device axis
+	bool per_axis;		// Device needs a constant effect per axis
+	SDL_atomic_t recreate;	// Effects are created anew outside the update, the profile saved later
+	bool profile_dirty;	// Profile is saved at the next reconfigure or when the device goes
+	bool loop_reverse;	// Closed loop forces push along the axis readings, not against
+
+	// Mapping, inversion and gains compiled by build_mix(), device axis
+	// levels are mix * { stick forces, pilot forces, vibration }
+	float mix[AXES][SOURCES];
+
+	bool shaker_on;
+	bool combined;		// X and Y share the CONST_X effect, pointed along their sum
+	unsigned int periodic_on;	// Running periodic effects, bit per effect
+	unsigned int software;	// Effects without a device slot, mixed into constant force
+	Sint16 condition_coeff[EFFECTS];	// Last coefficients sent to remote condition effects
+	Sint16 trim_center[AXES];	// Spring centre moved by force trim
+
+	// Closed loop state, stick position -1 - 1 and its velocity per second
+	bool closed_loop;
+	float position[AXES];
+	float velocity[AXES];
+
+	benchResults bench;
+	struct __deviceJob *job;	// Startup job collecting messages of the device, NULL = print them
+	unsigned int update_time;	// Last constant force update, when bench.rate limits them
+
+	// Force stream samples, interleaved by axis, and the levels of the last round
+	Uint16 stream_data[STREAM_SAMPLES * AXES];
+	float stream_last[AXES];
+	unsigned int stream_time;	// Last upload, sample 0 played then
+	unsigned int stream_round;	// Last round
+	bool stream_running;
+
+	forceBuffer out;	// Levels for the output thread
+
+	// Buffet and turbulence noise, a lane per control axis for each
+	Uint32 noise[2 * AXES];
+	float band_fast[2 * AXES], band_slow[2 * AXES];
 
 	float lowpass;		// Low pass filter tau, in ms
 
 } hapticDevice;
 
 static hapticDevice *devices = NULL;
-bool reconf_request = false;
-bool quit = false;
 
-effectParams new_params;
+// Numbers given to devices, so an unplugged device gets its number and
+// with it its instance routing back when replugged
+#define MAX_KNOWN	64
+struct {
+	char guid[33];
+	int guid_index;
+	unsigned int num;
+} known_devices[MAX_KNOWN];
+int num_known = 0;
+volatile sig_atomic_t quit = 0;	// Set by ctrl+c once the loop runs
+bool hold_neutral = false;	// Set through the control socket, devices are kept neutral
+
+// Real-time mode. The update loop runs with SCHED_FIFO priority and wakes
+// at absolute deadlines, so a busy host can't stretch its period.
+#define RT_PRIORITY	40	// Below kernel interrupt threads, USB must keep up
+#define RT_PREFAULT	(256 * 1024)	// Stack touched before locking memory
+#define RT_MISS_US	2000	// Waking later than this is a deadline miss
+#define RT_REPORT	10000	// Deadline miss report interval, ms
+
+struct {
+	bool enabled;
+	int cpu;		// CPU to run on, -1 = any
+	struct timespec next;	// Next deadline, CLOCK_MONOTONIC
+	unsigned int misses, reported, next_report;
+	long worst;		// Latest wake-up, us
+} rt = { .cpu = -1 };
+
+// Output thread of real-time mode. Forces go to local devices from a thread
+// of its own at fixed deadlines, so network and file I/O of the update loop
+// can't delay them. devices and the effects in it only change under lock,
+// which the output thread tries, skipping the period if it is taken.
+struct {
+	SDL_Thread *thread;
+	SDL_mutex *lock;	// NULL = no output thread, forces are sent by the loop
+	SDL_sem *wake;
+	SDL_atomic_t sleeping;	// Waiting for a device to update
+	SDL_atomic_t stop;
+	unsigned int skipped;	// Periods lost to the lock
+} output;
+
+// Local control socket, to query and tune devices without going through
+// flightgear. Commands and replies are lines of text, each reply ends with
+// a line of "ok" or "error <reason>".
+#define MAX_CONTROL	4	// Control clients connected at once
+
+typedef struct __controlClient {
+	int fd;			// -1 = free
+	char in[MAXMSG];
+	int inlen;
+} controlClient;
+
+struct {
+	char path[PATHLEN];	// Empty = no control socket
+	int fd;
+	controlClient client[MAX_CONTROL];
+
+	// Update loop statistics since the last stats command
+	unsigned int since, loops, max_dt;
+} control = { .fd = -1 };
 
 /*
  * prototypes
  */
 void abort_execution(int signal);
-void HapticPrintSupported(SDL_Haptic * haptic);
+void cleanup(void);
+void stop_loop(int signal);
+void HapticPrintSupported(hapticDevice * dev);
+void device_print(hapticDevice * dev, const char *fmt, ...);
+void create_device_effects(hapticDevice * dev);
+bool reload_effect(hapticDevice * device, SDL_HapticEffect * effect, int *effectId, bool run);
+void save_profile(hapticDevice * dev, const char *aircraft);
+void send_devices(fgInstance * fg);
+hapticDevice *find_device(unsigned int num);
+bool fg_lost(fgInstance * fg);
+void output_forces(hapticDevice * dev, float x, float y, float z, bool shaker);
+void remote_send_forces(hapticDevice * dev, float x, float y, float z, bool shaker);
+void remote_send_devices(void);
+void remote_send_removed(hapticDevice * dev);
+void remote_send_config(hapticDevice * dev);
+void remote_send_periodic(hapticDevice * dev, int effect, Uint16 period, Sint16 magnitude);
+unsigned int periodic_type(hapticDevice * dev, int effect);
+bool has_periodic(hapticDevice * dev, int effect);
+void output_periodic(hapticDevice * dev, int effect, float period, float magnitude);
+void remote_send_condition(hapticDevice * dev, int effect, Sint16 coeff);
+unsigned int condition_type(int effect);
+bool has_condition(hapticDevice * dev, int effect);
+void output_condition(hapticDevice * dev, int effect, float coeff);
+void control_poll(unsigned int now);
+void wake_instances(void);
+void close_control(void);
 
 float clamp(float x, float l, float h)
 {
 	return ((x) > (h) ? (h) : ((x) < (l) ? (l) : (x)));
 }
 
-void init_haptic(void)
+/*
+ * Keeps the output thread away from devices while they are changed.
+ */
+void output_lock(void)
 {
-	/* Initialize the force feedbackness */
-	SDL_Init(SDL_INIT_TIMER | SDL_INIT_JOYSTICK | SDL_INIT_HAPTIC);
+	if (output.lock)
+		SDL_LockMutex(output.lock);
+}
 
-	// Initialize network
-	SDLNet_Init();
+void output_unlock(void)
+{
+	if (output.lock)
+		SDL_UnlockMutex(output.lock);
+}
 
-	num_devices = SDL_NumHaptics();
-	printf("%d Haptic devices detected.\n", num_devices);
+/*
+ * Publishes a frame for the output thread. Only the update loop writes.
+ */
+void write_frame(hapticDevice * dev, const forceFrame * f)
+{
+	int seq = SDL_AtomicGet(&dev->out.seq);
+
+	dev->out.frame[(seq + 1) & 1] = *f;
+	SDL_AtomicSet(&dev->out.seq, seq + 1);
+
+	if (f->active && SDL_AtomicCAS(&output.sleeping, 1, 0))
+		SDL_SemPost(output.wake);
+}
+
+/*
+ * Copies the latest frame. A write during the copy may have started on the
+ * same buffer, so that copy is taken again.
+ */
+void read_frame(hapticDevice * dev, forceFrame * f)
+{
+	int seq;
+
+	do {
+		seq = SDL_AtomicGet(&dev->out.seq);
+		*f = dev->out.frame[seq & 1];
+	} while (SDL_AtomicGet(&dev->out.seq) != seq);
+}
+
+/*
+ * Sets the default configuration for a freshly opened device.
+ */
+void default_device_params(hapticDevice * dev)
+{
+	for (int a = 0; a < dev->axes && a < AXES; a++) {
+		dev->pilot_axes[a] = a;
+		dev->stick_axes[a] = a;
+	}
+	for (int a = dev->axes; a < AXES; a++) {
+		dev->pilot_axes[a] = -1;
+		dev->stick_axes[a] = -1;
+	}
+
+	dev->autocenter = 0.0;
+	dev->gain = 1.0;
+	dev->pilot_gain = 0.1;
+	dev->stick_gain = 1.0;
+	dev->shaker_gain = 1.0;
+	dev->shaker_period = 100.0;
+	dev->rumble_gain = 0.4;
+	dev->engine_gain = 0.3;
+	dev->spring_gain = 0.5;
+	dev->damper_gain = 0.2;
+	dev->friction_gain = 0.05;
+	dev->buffet_gain = 0.3;
+	dev->turbulence_gain = 0.2;
+	dev->lowpass = 300.0;
+
+	// Xorshift must not start from zero, and devices shouldn't shake in step
+	for (int k = 0; k < 2 * AXES; k++)
+		dev->noise[k] = 0x9E3779B9 * (dev->num * 2 * AXES + k + 1);
+
+	for (int x = 0; x < EFFECTS; x++)
+		dev->effectId[x] = -1;
+}
+
+/*
+ * Device profiles keep the capabilities and last tuned settings of each
+ * device on disk, so devices come up configured before flightgear has
+ * loaded. They are stored as <dir>/<device>.conf, aircraft specific ones
+ * as <dir>/<aircraft>/<device>.conf. Lines are of form "key value".
+ */
+#define PROFILE_CAPS		1	// Apply capabilities
+#define PROFILE_SETTINGS	2	// Apply tuned settings
+
+#define PROFILE_PATHLEN	(PATHLEN + 2 * NAMELEN + 8)
+
+char profile_dir[PATHLEN] = "";
+
+// Float settings saved in profiles, their properties under /haptic/device[n]
+// and the range they are kept in. Device gains are percentages for SDL, the
+// low pass filter divides by its tau.
+const struct {
+	const char *key;
+	const char *node;
+	size_t offset;
+	float min, max;
+} profile_floats[] = {
+	{ "autocenter", "autocenter", offsetof(hapticDevice, autocenter), 0.0, 1.0 },
+	{ "gain", "gain", offsetof(hapticDevice, gain), 0.0, 1.0 },
+	{ "pilot-gain", "pilot/gain", offsetof(hapticDevice, pilot_gain), 0.0, 5.0 },
+	{ "stick-gain", "stick-force/gain", offsetof(hapticDevice, stick_gain), 0.0, 5.0 },
+	{ "shaker-gain", "stick-shaker/gain", offsetof(hapticDevice, shaker_gain), 0.0, 1.0 },
+	{ "rumble-gain", "ground-rumble/gain", offsetof(hapticDevice, rumble_gain), 0.0, 5.0 },
+	{ "engine-gain", "engine-vibration/gain", offsetof(hapticDevice, engine_gain), 0.0, 5.0 },
+	{ "spring-gain", "spring/gain", offsetof(hapticDevice, spring_gain), 0.0, 5.0 },
+	{ "damper-gain", "damper/gain", offsetof(hapticDevice, damper_gain), 0.0, 5.0 },
+	{ "friction-gain", "friction/gain", offsetof(hapticDevice, friction_gain), 0.0, 5.0 },
+	{ "buffet-gain", "buffet/gain", offsetof(hapticDevice, buffet_gain), 0.0, 5.0 },
+	{ "turbulence-gain", "turbulence/gain", offsetof(hapticDevice, turbulence_gain), 0.0, 5.0 },
+	{ "low-pass-filter", "low-pass-filter", offsetof(hapticDevice, lowpass), 1.0, 10000.0 },
+};
+
+#define PROFILE_FLOATS	(sizeof(profile_floats) / sizeof(profile_floats[0]))
+
+/*
+ * Replaces characters that don't belong in file names.
+ */
+void profile_name(char *dst, const char *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; src[i] && i < len - 1; i++)
+		dst[i] = isalnum((unsigned char)src[i]) || strchr("-_.", src[i]) ? src[i] : '_';
+	dst[i] = '\0';
+	if (dst[0] == '.')
+		dst[0] = '_';
+}
+
+/*
+ * Path of the profile of dev, aircraft NULL for the common one. Devices are
+ * known by their GUID, remote ones by name. Returns false if profiles are
+ * not in use.
+ */
+bool profile_path(hapticDevice * dev, const char *aircraft, char *path, size_t len)
+{
+	char device[NAMELEN + 12];
+
+	if (!profile_dir[0])
+		return false;
+
+	// Second and later devices of the same model are told apart by index
+	profile_name(device, dev->guid[0] ? dev->guid : dev->name, NAMELEN + 1);
+	if (dev->guid_index > 0)
+		snprintf(device + strlen(device), 12, "-%d", dev->guid_index + 1);
+	if (aircraft)
+		snprintf(path, len, "%s/%s/%s.conf", profile_dir, aircraft, device);
+	else
+		snprintf(path, len, "%s/%s.conf", profile_dir, device);
+	return true;
+}
+
+/*
+ * Reads the parts of a profile selected by what into dev. Returns false if
+ * the profile does not exist, or what was asked for is not in it.
+ */
+bool load_profile(hapticDevice * dev, const char *aircraft, int what)
+{
+	char path[PROFILE_PATHLEN];
+	char line[MAXMSG], key[NAMELEN + 1];
+	int a[AXES], caps = 0;
+	float f;
+	benchResults *b = &dev->bench;
+	FILE *file;
+
+	if (!profile_path(dev, aircraft, path, sizeof(path)) || !(file = fopen(path, "r")))
+		return false;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%30s", key) != 1 || key[0] == '#')
+			continue;
+
+		if (what & PROFILE_CAPS) {
+			if (strcmp(key, "supported") == 0 && sscanf(line, "%*s %u", &dev->supported) == 1)
+				caps++;
+			else if (strcmp(key, "axes") == 0 && sscanf(line, "%*s %u", &dev->axes) == 1)
+				caps++;
+			else if (strcmp(key, "effects") == 0 && sscanf(line, "%*s %u", &dev->numEffects) == 1)
+				caps++;
+			else if (strcmp(key, "effects-playing") == 0 && sscanf(line, "%*s %u", &dev->numEffectsPlaying) == 1)
+				caps++;
+
+			// Benchmark results, optional
+			else if (strcmp(key, "update-rate") == 0)
+				sscanf(line, "%*s %f", &b->rate);
+			else if (strcmp(key, "update-latency-running") == 0)
+				sscanf(line, "%*s %f %f %f %f", &b->running[0], &b->running[1], &b->running[2], &b->running[3]);
+			else if (strcmp(key, "update-latency-stopped") == 0)
+				sscanf(line, "%*s %f %f %f %f", &b->stopped[0], &b->stopped[1], &b->stopped[2], &b->stopped[3]);
+			else if (strcmp(key, "update-stops-effect") == 0)
+				sscanf(line, "%*s %d", &b->stops);
+			else if (strcmp(key, "effect-slots") == 0)
+				sscanf(line, "%*s %d", &b->slots);
+		}
+
+		if (!(what & PROFILE_SETTINGS))
+			continue;
+
+		for (int k = 0; k < PROFILE_FLOATS; k++)
+			if (strcmp(key, profile_floats[k].key) == 0 && sscanf(line, "%*s %f", &f) == 1 && isfinite(f))
+				*(float *)((char *)dev + profile_floats[k].offset) =
+				    clamp(f, profile_floats[k].min, profile_floats[k].max);
+
+		if (strcmp(key, "shaker-direction") == 0 && sscanf(line, "%*s %f", &f) == 1)
+			dev->shaker_dir = f;
+		else if (strcmp(key, "shaker-period") == 0 && sscanf(line, "%*s %f", &f) == 1)
+			dev->shaker_period = f;
+		else if (strcmp(key, "pilot-axes") == 0 && sscanf(line, "%*s %d %d %d", &a[0], &a[1], &a[2]) == AXES)
+			for (int x = 0; x < AXES; x++)
+				dev->pilot_axes[x] = a[x];
+		else if (strcmp(key, "stick-axes") == 0 && sscanf(line, "%*s %d %d %d", &a[0], &a[1], &a[2]) == AXES)
+			for (int x = 0; x < AXES; x++)
+				dev->stick_axes[x] = a[x];
+		else if (strcmp(key, "invert-axes") == 0 && sscanf(line, "%*s %d %d %d", &a[0], &a[1], &a[2]) == AXES)
+			for (int x = 0; x < AXES; x++)
+				dev->invert[x] = a[x];
+		else if (strcmp(key, "per-axis-constant") == 0 && sscanf(line, "%*s %d", &a[0]) == 1)
+			dev->per_axis = a[0];
+		else if (strcmp(key, "closed-loop-reverse") == 0 && sscanf(line, "%*s %d", &a[0]) == 1)
+			dev->loop_reverse = a[0];
+	}
+	fclose(file);
+
+	if (dev->axes > AXES)
+		dev->axes = AXES;
+
+	return !(what & PROFILE_CAPS) || caps == 4;
+}
+
+// Profiles saved while the loop runs are written out by the log thread,
+// in the order they were saved
+#define PROFILE_TEXT	4096	// Formatted profile
+
+typedef struct __profileWrite {
+	struct __profileWrite *next;
+	char dir[PROFILE_PATHLEN];	// Aircraft directory to create, empty = none
+	char path[PROFILE_PATHLEN];
+	char text[PROFILE_TEXT];
+	int len;
+} profileWrite;
+
+void profile_printf(profileWrite * w, const char *fmt, ...)
+{
+	va_list va;
+	int len;
+
+	va_start(va, fmt);
+	len = vsnprintf(&w->text[w->len], PROFILE_TEXT - w->len, fmt, va);
+	va_end(va);
+	if (len > 0)
+		w->len = w->len + len < PROFILE_TEXT ? w->len + len : PROFILE_TEXT - 1;
+}
+
+void write_profile(const profileWrite * w)
+{
+	FILE *file;
+
+	mkdir(profile_dir, 0755);
+	if (w->dir[0])
+		mkdir(w->dir, 0755);
+
+	file = fopen(w->path, "w");
+	if (!file) {
+		log_msg(LOG_ERROR, "Unable to save device profile %s: %s", w->path, strerror(errno));
+		return;
+	}
+	fputs(w->text, file);
+	fclose(file);
+}
+
+/*
+ * Writes out the queued profiles. Called by the log thread, and at exit.
+ */
+void write_profiles(void)
+{
+	profileWrite *w;
+
+	if (!logger.profile_lock)
+		return;
+
+	SDL_LockMutex(logger.profile_lock);
+	w = logger.profiles;
+	logger.profiles = logger.profiles_last = NULL;
+	SDL_UnlockMutex(logger.profile_lock);
+
+	while (w) {
+		profileWrite *next = w->next;
+
+		write_profile(w);
+		free(w);
+		w = next;
+	}
+}
+
+/*
+ * Writes capabilities and settings of dev into its profile. While the loop
+ * runs the profile is only formatted here and written by the log thread.
+ */
+void save_profile(hapticDevice * dev, const char *aircraft)
+{
+	profileWrite *w;
+
+	w = malloc(sizeof(profileWrite));
+	if (!w)
+		return;
+	if (!profile_path(dev, aircraft, w->path, sizeof(w->path))) {
+		free(w);
+		return;
+	}
+	if (!aircraft)
+		dev->profile_dirty = false;
+
+	w->dir[0] = '\0';
+	if (aircraft)
+		snprintf(w->dir, sizeof(w->dir), "%s/%s", profile_dir, aircraft);
+
+	w->len = 0;
+	w->text[0] = '\0';
+	profile_printf(w, "# fg-haptic profile of %s\n", dev->name);
+	if (!dev->remote) {
+		profile_printf(w, "supported %u\n", dev->supported);
+		profile_printf(w, "axes %u\n", dev->axes);
+		profile_printf(w, "effects %u\n", dev->numEffects);
+		profile_printf(w, "effects-playing %u\n", dev->numEffectsPlaying);
+		if (dev->bench.rate > 0.0) {
+			benchResults *b = &dev->bench;
+
+			profile_printf(w, "update-rate %f\n", b->rate);
+			profile_printf(w, "update-latency-running %.0f %.0f %.0f %.0f\n",
+				       b->running[0], b->running[1], b->running[2], b->running[3]);
+			profile_printf(w, "update-latency-stopped %.0f %.0f %.0f %.0f\n",
+				       b->stopped[0], b->stopped[1], b->stopped[2], b->stopped[3]);
+			profile_printf(w, "update-stops-effect %d\n", b->stops);
+			profile_printf(w, "effect-slots %d\n", b->slots);
+		}
+	}
+	for (int k = 0; k < PROFILE_FLOATS; k++)
+		profile_printf(w, "%s %f\n", profile_floats[k].key, *(float *)((char *)dev + profile_floats[k].offset));
+	profile_printf(w, "shaker-direction %u\n", dev->shaker_dir);
+	profile_printf(w, "shaker-period %u\n", dev->shaker_period);
+	profile_printf(w, "pilot-axes %d %d %d\n", dev->pilot_axes[0], dev->pilot_axes[1], dev->pilot_axes[2]);
+	profile_printf(w, "stick-axes %d %d %d\n", dev->stick_axes[0], dev->stick_axes[1], dev->stick_axes[2]);
+	profile_printf(w, "invert-axes %d %d %d\n", dev->invert[0], dev->invert[1], dev->invert[2]);
+	profile_printf(w, "per-axis-constant %d\n", dev->per_axis);
+	profile_printf(w, "closed-loop-reverse %d\n", dev->loop_reverse);
+
+	if (!logger.loop || !logger.thread || !logger.profile_lock) {
+		write_profile(w);
+		free(w);
+		return;
+	}
+
+	w->next = NULL;
+	SDL_LockMutex(logger.profile_lock);
+	if (logger.profiles_last)
+		logger.profiles_last->next = w;
+	else
+		logger.profiles = w;
+	logger.profiles_last = w;
+	SDL_UnlockMutex(logger.profile_lock);
+	SDL_SemPost(logger.wake);
+}
+
+/*
+ * Applies the profiles of the aircraft flightgear instance fg is flying
+ * to its devices. p is the reply to "get /sim/aircraft".
+ */
+void load_aircraft_profiles(fgInstance * fg, const char *p)
+{
+	fg->aircraft[0] = '\0';
+	if (!p || !p[0] || !profile_dir[0])
+		return;
+	profile_name(fg->aircraft, p, sizeof(fg->aircraft));
+	log_msg(LOG_INFO, "Flightgear instance %d is flying %s", fg->num, fg->aircraft);
+
+	for (int i = 0; i < num_devices; i++) {
+		bool loaded;
+
+		if (devices[i].fg != fg)
+			continue;
+
+		// Start over from the common profile, in case the last aircraft had its own
+		loaded = load_profile(&devices[i], NULL, PROFILE_SETTINGS);
+		if (load_profile(&devices[i], fg->aircraft, PROFILE_SETTINGS)) {
+			log_msg(LOG_INFO, "Using %s profile for device %d", fg->aircraft, devices[i].num);
+			loaded = true;
+		}
+		if (loaded)
+			create_device_effects(&devices[i]);
+	}
+}
+
+/*
+ * Parses a flightgear instance description of form
+ * generic-port:telnet-host:telnet-port[:device,device...]
+ */
+bool add_instance(const char *spec)
+{
+	fgInstance *fg;
+	int len = 0;
+	unsigned int num;
+
+	if (num_instances >= MAX_INSTANCES)
+		return false;
+
+	fg = &instances[num_instances];
+	memset(fg, 0, sizeof(fgInstance));
+	if (sscanf(spec, "%d:%30[^:]:%d%n", &fg->generic_port, fg->host, &fg->telnet_port, &len) != 3)
+		return false;
+
+	spec += len;
+	if (*spec == ':') {
+		int ignored = 0;
+
+		while (sscanf(++spec, "%u%n", &num, &len) == 1) {
+			if (fg->num_routed < MAX_ROUTED)
+				fg->routed[fg->num_routed++] = num;
+			else
+				ignored++;
+			spec += len;
+			if (*spec != ',')
+				break;
+		}
+		if (ignored)
+			printf("Instance at port %d drives at most %d devices, %d more ignored\n",
+			       fg->generic_port, MAX_ROUTED, ignored);
+	}
+	if (*spec != '\0')
+		return false;
+
+	fg->num = ++num_instances;
+	fg->state = FG_WAITING;
+	return true;
+}
+
+/*
+ * Selects the flightgear instance driving a device. Explicitly routed devices
+ * go to their instance, the rest to the first instance without a device list.
+ */
+void route_device(hapticDevice * dev)
+{
+	dev->fg = NULL;
+	for (int n = 0; n < num_instances; n++)
+		for (int k = 0; k < instances[n].num_routed; k++)
+			if (instances[n].routed[k] == dev->num)
+				dev->fg = &instances[n];
+
+	for (int n = 0; n < num_instances && !dev->fg; n++)
+		if (instances[n].num_routed == 0)
+			dev->fg = &instances[n];
+
+	if (dev->fg)
+		log_msg(LOG_INFO, "Device %d is driven by flightgear instance %d", dev->num, dev->fg->num);
+	else if (remote.mode != REMOTE_SERVER)
+		log_msg(LOG_WARN, "Device %d is not routed to any flightgear instance", dev->num);
+}
+
+/*
+ * Returns true if a device in devices other than dev has number num.
+ */
+bool device_number_used(hapticDevice * dev, unsigned int num)
+{
+	for (int i = 0; i < num_devices; i++)
+		if (&devices[i] != dev && devices[i].num == num)
+			return true;
+	return false;
+}
+
+/*
+ * Picks the number of a device being opened. A device seen before gets its
+ * old number back, a new one the lowest number no other device has had.
+ * Numbers start from one, so we get around flightgear reading empty
+ * properties as 0.
+ */
+unsigned int device_number(hapticDevice * dev)
+{
+	unsigned int num;
+	int k;
+
+	for (k = 0; k < num_known; k++)
+		if (known_devices[k].guid_index == dev->guid_index && strcmp(known_devices[k].guid, dev->guid) == 0)
+			break;
+	if (k < num_known && !device_number_used(dev, known_devices[k].num))
+		return known_devices[k].num;
+
+	// Skip numbers kept for unplugged devices
+	for (num = 1;; num++) {
+		bool kept = false;
+
+		for (int j = 0; j < num_known; j++)
+			if (known_devices[j].num == num)
+				kept = true;
+		if (!kept && !device_number_used(dev, num))
+			break;
+	}
 
-	devices = (hapticDevice *) malloc(num_devices * sizeof(hapticDevice));
-	if (!devices) {
-		printf("Fatal error: Could not allocate memory for devices!\n");
+	if (k == num_known && num_known < MAX_KNOWN) {
+		strcpy(known_devices[k].guid, dev->guid);
+		known_devices[k].guid_index = dev->guid_index;
+		num_known++;
+	}
+	if (k < num_known)
+		known_devices[k].num = num;
+	return num;
+}
+
+/*
+ * Grows devices by one zeroed entry, which is counted in num_devices
+ * by the caller once the device is set up.
+ */
+hapticDevice *append_device(void)
+{
+	hapticDevice *tmp;
+
+	output_lock();
+	tmp = (hapticDevice *) realloc(devices, (num_devices + 1) * sizeof(hapticDevice));
+	if (!tmp) {
+		log_msg(LOG_ERROR, "Fatal error: Could not allocate memory for devices!");
 		abort_execution(-1);
 	}
-	// Zero
-	memset(devices, 0, num_devices * sizeof(hapticDevice));
+	devices = tmp;
+	output_unlock();
+
+	memset(&devices[num_devices], 0, sizeof(hapticDevice));
+	return &devices[num_devices];
+}
+
+/*
+ * Counts in the device last appended, once it is set up. Returns its index.
+ */
+int add_device(void)
+{
+	int i;
+
+	output_lock();
+	i = num_devices++;
+	output_unlock();
+	return i;
+}
+
+/*
+ * Opens the haptic part of joystick joy_index and appends it to devices.
+ * Returns the index of the new device, or -1 if the joystick has no force
+ * feedback, is already open or could not be opened.
+ */
+int open_device(int joy_index)
+{
+	SDL_Joystick *joystick;
+	SDL_JoystickID instance;
+	hapticDevice *dev;
+	bool cached;
+
+	joystick = SDL_JoystickOpen(joy_index);
+	if (!joystick) {
+		device_print(NULL, "Unable to open joystick %d: %s\n", joy_index, SDL_GetError());
+		return -1;
+	}
 
-	// Send all devices' data to flightgear
+	// SDL reports the devices present at startup as added too, skip the ones we have
+	instance = SDL_JoystickInstanceID(joystick);
 	for (int i = 0; i < num_devices; i++) {
-		devices[i].num = i + 1;	// Add one, so we get around flightgear reading empty properties as 0
-		devices[i].device = SDL_HapticOpen(i);
-
-		if (devices[i].device) {
-			devices[i].open = true;
-
-			HapticPrintSupported(devices[i].device);
-			// Copy devices name with ascii
-			const char *p = SDL_HapticName(i);
-			strncpy(devices[i].name, p, NAMELEN);
-
-			// Add device number after name, if there is multiples with same name
-			for (int a = 0; a < i; a++) {
-				if (strcmp(devices[i].name, devices[a].name) == 0) {
-					size_t len = strlen(devices[i].name);
-					if (len < NAMELEN - 2) {	// Enough space to add number after name
-						devices[i].name[len] = ' ';
-						devices[i].name[len + 1] = '1' + i;
-					} else {
-						devices[i].name[NAMELEN - 2] = ' ';
-						devices[i].name[NAMELEN - 1] = '1' + i;
-					}
-				}
-			}
+		if (devices[i].instance == instance) {
+			SDL_JoystickClose(joystick);	// Drop the extra reference
+			return -1;
+		}
+	}
 
-			printf("Device %d name is %s\n", devices[i].num, devices[i].name);
+	if (SDL_JoystickIsHaptic(joystick) != 1) {
+		SDL_JoystickClose(joystick);
+		return -1;
+	}
 
-			// Capabilities
-			devices[i].supported = SDL_HapticQuery(devices[i].device);
-			devices[i].axes = SDL_HapticNumAxes(devices[i].device);
-			if (devices[i].axes > AXES)
-				devices[i].axes = AXES;
-			devices[i].numEffects = SDL_HapticNumEffects(devices[i].device);
-			devices[i].numEffectsPlaying = SDL_HapticNumEffectsPlaying(devices[i].device);
+	dev = append_device();
+	dev->joystick = joystick;
+	dev->instance = instance;
 
-			// Default effect parameters
-			for (int a = 0; a < devices[i].axes && a < AXES; a++) {
-				devices[i].pilot_axes[a] = a;
-				devices[i].stick_axes[a] = a;
+	dev->device = SDL_HapticOpenFromJoystick(joystick);
+	if (!dev->device) {
+		device_print(dev, "Unable to open haptic device %d: %s\n", joy_index, SDL_GetError());
+		SDL_JoystickClose(joystick);
+		return -1;
+	}
+	dev->open = true;
+	SDL_JoystickGetGUIDString(SDL_JoystickGetGUID(joystick), dev->guid, sizeof(dev->guid));
+
+	// Identical sticks share a GUID, each gets the lowest index not in use
+	// so it keeps its own profile across hot-plugs
+	for (int a = 0; a < num_devices; a++) {
+		if (!devices[a].remote && devices[a].guid_index == dev->guid_index
+		    && strcmp(devices[a].guid, dev->guid) == 0) {
+			dev->guid_index++;
+			a = -1;	// Check the new index against all
+		}
+	}
+	dev->num = device_number(dev);
+
+	// Copy devices name with ascii
+	const char *p = SDL_JoystickName(joystick);
+	strncpy(dev->name, p ? p : "Unknown", NAMELEN);
+
+	// Add device number after name, if there is multiples with same name
+	for (int a = 0; a < num_devices; a++) {
+		if (strcmp(dev->name, devices[a].name) == 0) {
+			size_t len = strlen(dev->name);
+			if (len < NAMELEN - 2) {	// Enough space to add number after name
+				dev->name[len] = ' ';
+				dev->name[len + 1] = '0' + dev->num % 10;
+			} else {
+				dev->name[NAMELEN - 2] = ' ';
+				dev->name[NAMELEN - 1] = '0' + dev->num % 10;
 			}
+		}
+	}
 
-			devices[i].autocenter = 0.0;
-			devices[i].gain = 1.0;
-			devices[i].pilot_gain = 0.1;
-			devices[i].stick_gain = 1.0;
-			devices[i].shaker_gain = 1.0;
-			devices[i].shaker_period = 100.0;
-			devices[i].rumble_gain = 0.4;
-			devices[i].lowpass = 300.0;
+	device_print(dev, "Device %d name is %s\n", dev->num, dev->name);
+	route_device(dev);
+
+	// Capabilities, from the profile if the device has been seen before
+	cached = load_profile(dev, NULL, PROFILE_CAPS);
+	if (!cached) {
+		dev->supported = SDL_HapticQuery(dev->device);
+		dev->axes = SDL_HapticNumAxes(dev->device);
+		if (dev->axes > AXES)
+			dev->axes = AXES;
+		dev->numEffects = SDL_HapticNumEffects(dev->device);
+		dev->numEffectsPlaying = SDL_HapticNumEffectsPlaying(dev->device);
+	}
+	HapticPrintSupported(dev);
 
-		} else {
-			printf("Unable to open haptic devices %d: %s\n", i, SDL_GetError());
-			devices[i].open = false;
-		}
+	default_device_params(dev);
+	if (cached && load_profile(dev, NULL, PROFILE_SETTINGS))
+		device_print(dev, "   Capabilities and settings loaded from profile\n");
+	else
+		save_profile(dev, NULL);
+
+	return add_device();
+}
+
+/*
+ * Closes device i and removes it from devices, shifting the rest down.
+ */
+void close_device(int i)
+{
+	if (devices[i].profile_dirty)
+		save_profile(&devices[i], NULL);
+
+	output_lock();
+	if (devices[i].device)
+		SDL_HapticClose(devices[i].device);
+	if (devices[i].joystick)
+		SDL_JoystickClose(devices[i].joystick);
+
+	num_devices--;
+	memmove(&devices[i], &devices[i + 1], (num_devices - i) * sizeof(hapticDevice));
+	output_unlock();
+}
+
+void init_haptic(void)
+{
+	/* Initialize the force feedbackness */
+	SDL_Init(SDL_INIT_TIMER | (remote.mode == REMOTE_CLIENT ? 0 : SDL_INIT_JOYSTICK | SDL_INIT_HAPTIC));
+
+	// Initialize network
+	SDLNet_Init();
+
+	// Devices of a remote force server are added as it describes them
+	if (remote.mode == REMOTE_CLIENT)
+		return;
+
+	// Haptic devices are opened through their joysticks, so they can be hot-plugged.
+	// One at a time, SDL keeps its list of open haptic devices without locking.
+	for (int i = 0; i < SDL_NumJoysticks(); i++) {
+		unsigned int start = SDL_GetTicks();
+
+		if (open_device(i) >= 0)
+			printf("   Opened in %u ms\n", SDL_GetTicks() - start);
 	}
 
+	printf("%d Haptic devices detected.\n", num_devices);
+
 	/* We only want force feedback errors. */
 	SDL_ClearError();
 }
 
-void send_devices(void)
+void send_devices(fgInstance * fg)
 {
+	int count = 0;
+
+	for (int i = 0; i < num_devices; i++)
+		if (devices[i].fg == fg)
+			count++;
+
+	// Announce everything in one go instead of a segment per property
+	fgfsbatch(&fg->telnet);
+
 	// Init general properties
-	fgfswrite(telnet_sock, "set /haptic/reconfigure 0");
+	fgfswrite(&fg->telnet, "set /haptic/reconfigure 0");
+	fgfswrite(&fg->telnet, "set /haptic/native-logic %d", native_logic);
 
 	// Init devices
-	for (int i = 0; i < num_devices; i++) {
+	for (int i = 0, n = 0; i < num_devices; i++) {
+		if (devices[i].fg != fg)
+			continue;	// Device belongs to another flightgear instance
+
 		// Write devices to flightgear
-		fgfswrite(telnet_sock, "set /haptic/device[%d]/number %d", i, devices[i].num);
-		fgfswrite(telnet_sock, "set /haptic/device[%d]/name %s", i, devices[i].name);
-		fgfswrite(telnet_sock, "set /haptic/device[%d]/supported %d", i, devices[i].supported);
-		fgfswrite(telnet_sock, "set /haptic/device[%d]/axes %d", i, devices[i].axes);
-		fgfswrite(telnet_sock, "set /haptic/device[%d]/num-effects %d", i, devices[i].numEffects);
-		fgfswrite(telnet_sock, "set /haptic/device[%d]/num-effects-playing %d", i, devices[i].numEffectsPlaying);
+		fgfswrite(&fg->telnet, "set /haptic/device[%d]/number %d", n, devices[i].num);
+		fgfswrite(&fg->telnet, "set /haptic/device[%d]/name %s", n, devices[i].name);
+		fgfswrite(&fg->telnet, "set /haptic/device[%d]/supported %d", n, devices[i].supported);
+		fgfswrite(&fg->telnet, "set /haptic/device[%d]/axes %d", n, devices[i].axes);
+		fgfswrite(&fg->telnet, "set /haptic/device[%d]/num-effects %d", n, devices[i].numEffects);
+		fgfswrite(&fg->telnet, "set /haptic/device[%d]/num-effects-playing %d", n, devices[i].numEffectsPlaying);
 
-		fgfswrite(telnet_sock, "set /haptic/device[%d]/low-pass-filter %.6f", i, devices[i].lowpass);
+		fgfswrite(&fg->telnet, "set /haptic/device[%d]/low-pass-filter %.6f", n, devices[i].lowpass);
 
 		// Write supported effects
 		if (devices[i].supported & SDL_HAPTIC_CONSTANT) {
 			// Constant force -> pilot G forces and aileron loading
 			// Currently support 3 axis only
 			for (int x = 0; x < devices[i].axes && x < AXES; x++) {
-				fgfswrite(telnet_sock, "set /haptic/device[%d]/pilot/%c %d", i, axes[x], devices[i].pilot_axes[x]);
-				fgfswrite(telnet_sock, "set /haptic/device[%d]/stick-force/%c %d", i, axes[x], devices[i].stick_axes[x]);
+				fgfswrite(&fg->telnet, "set /haptic/device[%d]/pilot/%c %d", n, axes[x], devices[i].pilot_axes[x]);
+				fgfswrite(&fg->telnet, "set /haptic/device[%d]/stick-force/%c %d", n, axes[x], devices[i].stick_axes[x]);
+				fgfswrite(&fg->telnet, "set /haptic/device[%d]/invert/%c %d", n, axes[x], devices[i].invert[x]);
 			}
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/pilot/gain %f", i, devices[i].pilot_gain);
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/stick-force/gain %f", i, devices[i].stick_gain);
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/stick-force/supported 1", i);
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/pilot/supported 1", i);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/pilot/gain %f", n, devices[i].pilot_gain);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/stick-force/gain %f", n, devices[i].stick_gain);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/stick-force/supported 1", n);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/pilot/supported 1", n);
+
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/ground-rumble/period 0.0", n);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/ground-rumble/gain %f", n, devices[i].rumble_gain);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/ground-rumble/supported 1", n);
+
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/buffet/gain %f", n, devices[i].buffet_gain);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/buffet/supported 1", n);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/turbulence/gain %f", n, devices[i].turbulence_gain);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/turbulence/supported 1", n);
+		}
 
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/ground-rumble/period 0.0", i);
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/ground-rumble/gain %f", i, devices[i].rumble_gain);
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/ground-rumble/supported 1", i);
+		if (periodic_type(&devices[i], ENGINE_VIBRATION) || (devices[i].supported & SDL_HAPTIC_CONSTANT)) {
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/engine-vibration/gain %f", n, devices[i].engine_gain);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/engine-vibration/supported 1", n);
+		}
+
+		// Condition effects -> control loading
+		if (devices[i].supported & SDL_HAPTIC_SPRING) {
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/spring/gain %f", n, devices[i].spring_gain);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/spring/supported 1", n);
+		}
+		if (devices[i].supported & SDL_HAPTIC_DAMPER) {
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/damper/gain %f", n, devices[i].damper_gain);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/damper/supported 1", n);
+		}
+		if (devices[i].supported & SDL_HAPTIC_FRICTION) {
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/friction/gain %f", n, devices[i].friction_gain);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/friction/supported 1", n);
 		}
 
-		if (devices[i].supported & SDL_HAPTIC_SINE) {
-			// Sine effect -> rumble is stick shaker
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/stick-shaker/direction %f", i, devices[i].shaker_dir);
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/stick-shaker/period %f", i, devices[i].shaker_period);
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/stick-shaker/gain %f", i, devices[i].shaker_gain);
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/stick-shaker/trigger 0", i);
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/stick-shaker/supported 1", i);
+		if (devices[i].supported & (SDL_HAPTIC_SINE | SDL_HAPTIC_CONSTANT)) {
+			// Sine effect -> rumble is stick shaker, or mixed into constant force
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/stick-shaker/direction %d", n, devices[i].shaker_dir);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/stick-shaker/period %d", n, devices[i].shaker_period);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/stick-shaker/gain %f", n, devices[i].shaker_gain);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/stick-shaker/trigger 0", n);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/stick-shaker/supported 1", n);
 		}
 
 		if (devices[i].supported & SDL_HAPTIC_GAIN) {
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/gain %f", i, devices[i].gain);
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/gain-supported 1", i);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/gain %f", n, devices[i].gain);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/gain-supported 1", n);
 		}
 		if (devices[i].supported & SDL_HAPTIC_AUTOCENTER) {
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/autocenter %f", i, devices[i].autocenter);
-			fgfswrite(telnet_sock, "set /haptic/device[%d]/autocenter-supported 1", i);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/autocenter %f", n, devices[i].autocenter);
+			fgfswrite(&fg->telnet, "set /haptic/device[%d]/autocenter-supported 1", n);
 		}
+		n++;
 	}
+
+	// Mark unplugged devices at the end of the list as gone
+	for (int n = count; n < fg->announced; n++) {
+		fgfswrite(&fg->telnet, "set /haptic/device[%d]/number 0", n);
+		fgfswrite(&fg->telnet, "set /haptic/device[%d]/name", n);
+	}
+	fg->announced = count;
+
+	fgfspush(&fg->telnet);
 }
 
-void read_devices(void)
+// Most gets sent for one device
+#define GETS_PER_DEVICE	(PROFILE_FLOATS + 3 * AXES + 2)
+
+/*
+ * Asks flightgear for setting node of device n, the reply is stored to the
+ * field at offset once it arrives.
+ */
+void request_setting(fgInstance * fg, int n, hapticDevice * dev, const char *node, size_t offset, int type)
 {
-	int idata;
+	settingGet *g = &fg->gets[fg->num_gets++];
+
+	fgfswrite(&fg->telnet, "get /haptic/device[%d]/%s", n, node);
+	g->num = dev->num;
+	g->offset = offset;
+	g->type = type;
+}
+
+/*
+ * Starts reading the device settings tuned in flightgear. The gets go out
+ * in one batch, update_reconfigure() collects the replies.
+ */
+void request_devices(fgInstance * fg, unsigned int now)
+{
+	settingGet *gets;
+	char node[32];
+
+	gets = realloc(fg->gets, (num_devices + 1) * GETS_PER_DEVICE * sizeof(settingGet));
+	if (!gets) {
+		log_msg(LOG_ERROR, "Out of memory reading device setup from FG instance %d", fg->num);
+		return;
+	}
+	fg->gets = gets;
+	fg->num_gets = fg->got = 0;
+
+	fgfsflush(&fg->telnet);
+
+	log_msg(LOG_INFO, "Reading device setup from FG instance %d", fg->num);
+
+	fgfsbatch(&fg->telnet);
+	for (int i = 0, n = 0; i < num_devices; i++) {
+		hapticDevice *dev = &devices[i];
+
+		if (dev->fg != fg)
+			continue;	// Device belongs to another flightgear instance
+
+		// Constant device settings
+		request_setting(fg, n, dev, "low-pass-filter", offsetof(hapticDevice, lowpass), SETTING_FLOAT);
+		if (dev->supported & SDL_HAPTIC_GAIN)
+			request_setting(fg, n, dev, "gain", offsetof(hapticDevice, gain), SETTING_FLOAT);
+		if (dev->supported & SDL_HAPTIC_AUTOCENTER)
+			request_setting(fg, n, dev, "autocenter", offsetof(hapticDevice, autocenter), SETTING_FLOAT);
+
+		// Constant force -> pilot G forces and aileron loading
+		// Currently support 3 axis only
+		if (dev->supported & SDL_HAPTIC_CONSTANT) {
+			for (int x = 0; x < dev->axes && x < AXES; x++) {
+				snprintf(node, sizeof(node), "pilot/%c", axes[x]);
+				request_setting(fg, n, dev, node, offsetof(hapticDevice, pilot_axes) + x, SETTING_AXIS);
+				snprintf(node, sizeof(node), "stick-force/%c", axes[x]);
+				request_setting(fg, n, dev, node, offsetof(hapticDevice, stick_axes) + x, SETTING_AXIS);
+				snprintf(node, sizeof(node), "invert/%c", axes[x]);
+				request_setting(fg, n, dev, node, offsetof(hapticDevice, invert) + x * sizeof(bool),
+						SETTING_BOOL);
+			}
+			request_setting(fg, n, dev, "pilot/gain", offsetof(hapticDevice, pilot_gain), SETTING_FLOAT);
+			request_setting(fg, n, dev, "stick-force/gain", offsetof(hapticDevice, stick_gain), SETTING_FLOAT);
+			request_setting(fg, n, dev, "ground-rumble/gain", offsetof(hapticDevice, rumble_gain),
+					SETTING_FLOAT);
+			request_setting(fg, n, dev, "buffet/gain", offsetof(hapticDevice, buffet_gain), SETTING_FLOAT);
+			request_setting(fg, n, dev, "turbulence/gain", offsetof(hapticDevice, turbulence_gain),
+					SETTING_FLOAT);
+		}
+
+		if (periodic_type(dev, ENGINE_VIBRATION) || (dev->supported & SDL_HAPTIC_CONSTANT))
+			request_setting(fg, n, dev, "engine-vibration/gain", offsetof(hapticDevice, engine_gain),
+					SETTING_FLOAT);
+
+		if (dev->supported & SDL_HAPTIC_SPRING)
+			request_setting(fg, n, dev, "spring/gain", offsetof(hapticDevice, spring_gain), SETTING_FLOAT);
+		if (dev->supported & SDL_HAPTIC_DAMPER)
+			request_setting(fg, n, dev, "damper/gain", offsetof(hapticDevice, damper_gain), SETTING_FLOAT);
+		if (dev->supported & SDL_HAPTIC_FRICTION)
+			request_setting(fg, n, dev, "friction/gain", offsetof(hapticDevice, friction_gain), SETTING_FLOAT);
+
+		if (dev->supported & (SDL_HAPTIC_SINE | SDL_HAPTIC_CONSTANT)) {
+			request_setting(fg, n, dev, "stick-shaker/direction", offsetof(hapticDevice, shaker_dir),
+					SETTING_USHORT);
+			request_setting(fg, n, dev, "stick-shaker/period", offsetof(hapticDevice, shaker_period),
+					SETTING_USHORT);
+			request_setting(fg, n, dev, "stick-shaker/gain", offsetof(hapticDevice, shaker_gain), SETTING_FLOAT);
+		}
+		n++;
+	}
+	fgfspush(&fg->telnet);
+
+	fg->reconf = RECONF_READING;
+	fg->reconf_end = now + READ_TIMEOUT * 1000;
+}
+
+/*
+ * Stores the reply p to get g, if its device is still there.
+ */
+void store_setting(fgInstance * fg, const settingGet * g, const char *p)
+{
+	hapticDevice *dev = find_device(g->num);
+	char *field;
 	float fdata;
-	int read = 0;
+	int idata;
+
+	if (!dev || dev->fg != fg)
+		return;
+	field = (char *)dev + g->offset;
+
+	if (g->type == SETTING_FLOAT || g->type == SETTING_USHORT) {
+		if (sscanf(p, "%f", &fdata) != 1)
+			return;
+		if (g->type == SETTING_FLOAT)
+			*(float *)field = fdata;
+		else
+			*(unsigned short *)field = fdata;
+	} else {
+		if (sscanf(p, "%d", &idata) != 1)
+			return;
+		if (g->type == SETTING_AXIS)
+			*(signed char *)field = idata;
+		else
+			*(bool *)field = idata;
+	}
+}
+
+/*
+ * Moves the reconfigure of fg along as flightgear replies, so a slow
+ * instance doesn't hold up the others.
+ */
+void update_reconfigure(fgInstance * fg, unsigned int now)
+{
 	const char *p;
+	int idata;
 
-	fgfsflush(telnet_sock);
+	if (fg->state != FG_RUNNING || fg_lost(fg))
+		return;
 
-	printf("Reading device setup from FG\n");
+	switch (fg->reconf) {
+	case RECONF_IDLE:
+		if (fg->reconf_request) {
+			fg->reconf_request = false;
+			request_devices(fg, now);
+		}
+		break;
+
+	case RECONF_READING:
+		while (fg->got < fg->num_gets && (p = fgfsreply(&fg->telnet)))
+			store_setting(fg, &fg->gets[fg->got++], p);
+		if (fg->got < fg->num_gets) {
+			if ((int)(now - fg->reconf_end) < 0)
+				break;
+			log_msg(LOG_WARN, "FG instance %d answered %d of %d setting reads", fg->num, fg->got,
+				fg->num_gets);
+		}
 
-	for (int i = 0; i < num_devices; i++) {
-		// Constant device settings
-		fgfswrite(telnet_sock, "get /haptic/device[%d]/low-pass-filter", i);
-		p = fgfsread(telnet_sock, READ_TIMEOUT);
-		if (p) {
-			read = sscanf(p, "%f", &fdata);
-			if (read == 1)
-				devices[i].lowpass = fdata;
+		fgfswrite(&fg->telnet, "set /haptic/reconfigure 0");
+		fgfswrite(&fg->telnet, "get /haptic/reconfigure");
+		log_msg(LOG_INFO, "Waiting for the command to go through...");
+		fg->reconf = RECONF_CONFIRM;
+		fg->reconf_end = now + READ_TIMEOUT * 1000;
+		break;
+
+	case RECONF_CONFIRM:
+		p = fgfsreply(&fg->telnet);
+		if (!p) {
+			if ((int)(now - fg->reconf_end) < 0)
+				break;
+		} else if (sscanf(p, "%d", &idata) == 1 && idata == 1) {
+			// Not through yet, ask again
+			fgfswrite(&fg->telnet, "get /haptic/reconfigure");
+			fg->reconf_end = now + READ_TIMEOUT * 1000;
+			break;
 		}
+		log_msg(LOG_INFO, "Device setup of FG instance %d read", fg->num);
 
-		if (devices[i].supported & SDL_HAPTIC_GAIN) {
-			fgfswrite(telnet_sock, "get /haptic/device[%d]/gain", i);
-			p = fgfsread(telnet_sock, READ_TIMEOUT);
-			if (p) {
-				read = sscanf(p, "%f", &fdata);
-				if (read == 1)
-					devices[i].gain = fdata;
-			}
+		fgfsflush(&fg->generic);	// Get rid of FF data that was received during reinitialization
+		fg->reconf_request = false;
+		fg->reconf = RECONF_IDLE;
+
+		for (int i = 0; i < num_devices; i++) {
+			if (devices[i].fg != fg)
+				continue;
+			create_device_effects(&devices[i]);
+
+			// Tuned settings become the default, and stick with the aircraft
+			save_profile(&devices[i], NULL);
+			if (fg->aircraft[0])
+				save_profile(&devices[i], fg->aircraft);
 		}
+		break;
+	}
+}
 
-		if (devices[i].supported & SDL_HAPTIC_AUTOCENTER) {
-			fgfswrite(telnet_sock, "get /haptic/device[%d]/autocenter", i);
-			p = fgfsread(telnet_sock, READ_TIMEOUT);
-			if (p) {
-				read = sscanf(p, "%f", &fdata);
-				if (read == 1)
-					devices[i].autocenter = fdata;
-			}
+/*
+ * Compiles axis mapping, inversion and gains of a device into its mixing
+ * matrix, so the update loop does not need to look at them.
+ */
+void build_mix(hapticDevice * dev)
+{
+	memset(dev->mix, 0, sizeof(dev->mix));
+
+	for (int a = 0; a < dev->axes && a < AXES; a++) {
+		float sign = dev->invert[a] ? -32760.0 : 32760.0;
+
+		if (dev->stick_axes[a] >= 0 && dev->stick_axes[a] < AXES)
+			dev->mix[a][dev->stick_axes[a]] += dev->stick_gain * sign;
+		if (dev->pilot_axes[a] >= 0 && dev->pilot_axes[a] < AXES)
+			dev->mix[a][AXES + dev->pilot_axes[a]] += dev->pilot_gain * sign;
+		if (dev->stick_axes[a] >= 0 && dev->stick_axes[a] < AXES)
+			dev->mix[a][FILTERED_SOURCES + dev->stick_axes[a]] += sign;
+	}
+}
+
+/*
+ * True if effect x is configured for the device at all, whether it is
+ * played by the device or mixed in software.
+ */
+bool want_effect(hapticDevice * dev, int x)
+{
+	switch (x) {
+	case CONST_Y:
+		if (dev->combined)
+			return false;	// Carried by CONST_X
+		/* fall through */
+	case CONST_X:
+	case CONST_Z:
+		if (dev->effectId[STREAM] != -1)
+			return false;
+		return (dev->supported & SDL_HAPTIC_CONSTANT) && dev->axes > x - CONST_X;
+	case STREAM:
+		return stream_output && (dev->supported & SDL_HAPTIC_CUSTOM) && dev->axes > 0;
+	case STICK_SHAKER:
+		return dev->shaker_gain > 0.001;
+	case GROUND_RUMBLE:
+		return dev->rumble_gain > 0.001 && dev->axes > 0;
+	case ENGINE_VIBRATION:
+		return dev->engine_gain > 0.001 && dev->axes > 0;
+	case SPRING:
+		return dev->spring_gain > 0.001 && dev->axes > 0 && !dev->closed_loop;
+	case DAMPER:
+		return dev->damper_gain > 0.001 && dev->axes > 0 && !dev->closed_loop;
+	case FRICTION:
+		return dev->friction_gain > 0.001 && dev->axes > 0;
+	}
+	return false;
+}
+
+/*
+ * Fills in effect x for uploading. Returns false if the device can't play it.
+ */
+bool setup_effect(hapticDevice * dev, int x)
+{
+	SDL_HapticEffect *e = &dev->effect[x];
+
+	switch (x) {
+	case CONST_X:
+	case CONST_Y:
+	case CONST_Z:
+		e->type = SDL_HAPTIC_CONSTANT;
+		e->constant.direction.type = SDL_HAPTIC_CARTESIAN;
+		e->constant.direction.dir[0] = x == CONST_X ? 0x1000 : 0;
+		e->constant.direction.dir[1] = x == CONST_Y ? -0x1000 : 0;
+		e->constant.direction.dir[2] = x == CONST_Z ? 0x1000 : 0;
+		e->constant.length = 60000;	// By default constant fore is always applied
+		e->constant.level = 0x1000;
+		return true;
+
+	case STREAM:
+		e->type = SDL_HAPTIC_CUSTOM;
+		e->custom.direction.type = SDL_HAPTIC_CARTESIAN;
+		e->custom.direction.dir[0] = 0x1000;
+		e->custom.direction.dir[1] = -0x1000;
+		e->custom.length = STREAM_SAMPLES;
+		e->custom.channels = dev->axes < AXES ? dev->axes : AXES;
+		e->custom.period = 1;
+		e->custom.samples = STREAM_SAMPLES;
+		e->custom.data = dev->stream_data;
+		memset(dev->stream_data, 0, sizeof(dev->stream_data));
+		memset(dev->stream_last, 0, sizeof(dev->stream_last));
+		dev->stream_running = false;
+		return true;
+
+	case STICK_SHAKER:
+		if (!(dev->supported & SDL_HAPTIC_SINE))
+			return false;
+		e->type = SDL_HAPTIC_SINE;
+		e->periodic.direction.type = SDL_HAPTIC_POLAR;
+		e->periodic.direction.dir[0] = dev->shaker_dir;
+		e->periodic.length = 5000;	// Default 5 seconds?
+		e->periodic.period = dev->shaker_period;
+		e->periodic.magnitude = 0x4000;
+		e->periodic.attack_length = 300;	// 0.3 sec fade in
+		e->periodic.fade_length = 300;	// 0.3 sec fade out
+		return true;
+
+	case GROUND_RUMBLE:
+	case ENGINE_VIBRATION:
+		// Ground rumble and engine vibration, started when needed
+		if (!periodic_type(dev, x) || dev->axes < 2)
+			return false;
+		e->type = periodic_type(dev, x);
+		e->periodic.direction.type = SDL_HAPTIC_CARTESIAN;
+		e->periodic.direction.dir[1] = -0x1000;	// Felt along Y axis like the airframe
+		e->periodic.length = SDL_HAPTIC_INFINITY;
+		e->periodic.period = 100;
+		e->periodic.magnitude = 0;
+		return true;
+
+	case SPRING:
+	case DAMPER:
+	case FRICTION:
+		// The device closes the loop, only coefficients are updated
+		if (!(dev->supported & condition_type(x)))
+			return false;
+		e->type = condition_type(x);
+		e->condition.length = SDL_HAPTIC_INFINITY;
+		for (int a = 0; a < dev->axes && a < AXES; a++) {
+			e->condition.right_sat[a] = 0xFFFF;
+			e->condition.left_sat[a] = 0xFFFF;
 		}
-		// Constant force -> pilot G forces and aileron loading
-		// Currently support 3 axis only
-		if (devices[i].supported & SDL_HAPTIC_CONSTANT) {
-			for (int x = 0; x < devices[i].axes && x < AXES; x++) {
-				fgfswrite(telnet_sock, "get /haptic/device[%d]/pilot/%c", i, axes[x]);
-				p = fgfsread(telnet_sock, READ_TIMEOUT);
-				if (p) {
-					read = sscanf(p, "%d", &idata);
-					if (read == 1)
-						devices[i].pilot_axes[x] = idata;
-				}
+		return true;
+	}
+	return false;
+}
 
-				fgfswrite(telnet_sock, "get /haptic/device[%d]/stick-force/%c", i, axes[x]);
-				p = fgfsread(telnet_sock, READ_TIMEOUT);
-				if (p) {
-					read = sscanf(p, "%d", &idata);
-					if (read == 1)
-						devices[i].stick_axes[x] = idata;
-				}
+/*
+ * Periodic effects can be mixed into a constant force when they don't get
+ * a slot of their own.
+ */
+bool software_effect(hapticDevice * dev, int x)
+{
+	if (x != STICK_SHAKER && x != GROUND_RUMBLE && x != ENGINE_VIBRATION)
+		return false;
+	return dev->effectId[CONST_Y] != -1 || dev->effectId[CONST_X] != -1 || dev->effectId[STREAM] != -1;
+}
+
+// Effects of local devices are created at startup by a thread each, as
+// some devices take hundreds of ms per effect. Messages of each device are
+// collected and printed in order once all are done.
+#define REPORTLEN	2048
+
+typedef struct __deviceJob {
+	hapticDevice *dev;
+	unsigned int ms;
+	char report[REPORTLEN];
+	size_t len;
+} deviceJob;
+
+/*
+ * printf for messages about dev, which are kept for later while a startup
+ * job runs for it.
+ */
+void device_print(hapticDevice * dev, const char *fmt, ...)
+{
+	deviceJob *job = dev ? dev->job : NULL;
+	va_list vl;
+
+	va_start(vl, fmt);
+	if (!job && logger.loop) {
+		char text[REPORTLEN];
+
+		vsnprintf(text, sizeof(text), fmt, vl);
+		for (char *line = strtok(text, "\n"); line; line = strtok(NULL, "\n"))
+			log_write(NULL, LOG_INFO, "%s", line);
+	} else if (!job) {
+		vprintf(fmt, vl);
+	} else if (job->len < REPORTLEN - 1) {
+		int len = vsnprintf(&job->report[job->len], REPORTLEN - job->len, fmt, vl);
+
+		if (len > 0)
+			job->len = job->len + len < REPORTLEN - 1 ? job->len + len : REPORTLEN - 1;
+	}
+	va_end(vl);
+}
+
+/*
+ * Maps the configured effects onto the slots of the device in order of
+ * importance. When the slots run out, periodic effects are mixed into the
+ * constant force and the rest are left out.
+ */
+void create_device_effects(hapticDevice * dev)
+{
+	unsigned int slots, used = 0;
+
+	build_mix(dev);
+
+	// Effects of remote devices are created by the force server
+	if (dev->remote) {
+		dev->periodic_on = 0;	// The server recreates them stopped
+		memset(dev->condition_coeff, 0, sizeof(dev->condition_coeff));
+		remote_send_config(dev);
+		return;
+	}
+
+	output_lock();
+
+	// Delete existing effects
+	for (int x = 0; x < EFFECTS; x++) {
+		if (dev->effectId[x] != -1)
+			SDL_HapticDestroyEffect(dev->device, dev->effectId[x]);
+		dev->effectId[x] = -1;
+	}
+	dev->software = 0;
+	dev->periodic_on = 0;
+	dev->shaker_on = false;
+
+	memset(&dev->effect[0], 0, sizeof(SDL_HapticEffect) * EFFECTS);
+
+	device_print(dev, "Creating effects for device %d\n", dev->num);
+
+	// Set autocenter and gain
+	if (dev->supported & SDL_HAPTIC_AUTOCENTER)
+		SDL_HapticSetAutocenter(dev->device, dev->autocenter * 100);
+
+	if (dev->supported & SDL_HAPTIC_GAIN)
+		SDL_HapticSetGain(dev->device, dev->gain * 100);
+
+	// Spring and damper from the stick position, when it can be read
+	dev->closed_loop = closed_loop && dev->joystick && (dev->supported & SDL_HAPTIC_CONSTANT)
+	    && SDL_JoystickNumAxes(dev->joystick) > 0;
+	memset(dev->position, 0, sizeof(dev->position));
+	memset(dev->velocity, 0, sizeof(dev->velocity));
+	if (dev->closed_loop)
+		device_print(dev, "   Spring and damper run in fg-haptic, from stick position\n");
+
+	// X and Y share one constant effect, unless the profile asks for one
+	// per axis or the device won't take it
+	dev->combined = !dev->per_axis && (dev->supported & SDL_HAPTIC_CONSTANT) && dev->axes > 1
+	    && !want_effect(dev, STREAM);
+	if (dev->combined) {
+		int id;
+
+		setup_effect(dev, CONST_X);
+		dev->effect[CONST_X].constant.direction.dir[1] = -0x1000;
+		if ((id = SDL_HapticNewEffect(dev->device, &dev->effect[CONST_X])) >= 0) {
+			SDL_HapticDestroyEffect(dev->device, id);
+			device_print(dev, "   X and Y share one constant force\n");
+		} else {
+			device_print(dev, "   Combined constant force not supported, using one per axis\n");
+			dev->combined = false;
+		}
+		memset(&dev->effect[CONST_X], 0, sizeof(SDL_HapticEffect));
+	}
+
+	// All effects may be playing at once
+	slots = dev->numEffects;
+	if (dev->numEffectsPlaying > 0 && dev->numEffectsPlaying < slots)
+		slots = dev->numEffectsPlaying;
+	if (dev->bench.slots > 0 && dev->bench.slots < slots)
+		slots = dev->bench.slots;	// Measured, drivers overstate it
+
+	for (int k = 0; k < EFFECTS; k++) {
+		int x = effect_priority[k];
+
+		if (!want_effect(dev, x))
+			continue;
+
+		if (used < slots && setup_effect(dev, x)) {
+			dev->effectId[x] = SDL_HapticNewEffect(dev->device, &dev->effect[x]);
+			if (dev->effectId[x] >= 0) {
+				used++;
+				// Condition effects run all the time
+				if (condition_type(x) && SDL_HapticRunEffect(dev->device, dev->effectId[x], 1) < 0)
+					device_print(dev, "Run error: %s\n", SDL_GetError());
+				continue;
 			}
-			fgfswrite(telnet_sock, "get /haptic/device[%d]/pilot/gain", i);
-			p = fgfsread(telnet_sock, READ_TIMEOUT);
-			if (p) {
-				read = sscanf(p, "%f", &fdata);
-				if (read == 1)
-					devices[i].pilot_gain = fdata;
+			device_print(dev, "UPLOADING %s EFFECT ERROR: %s\n", effect_names[x], SDL_GetError());
+			dev->effectId[x] = -1;
+			memset(&dev->effect[x], 0, sizeof(SDL_HapticEffect));
+		}
+
+		if (software_effect(dev, x)) {
+			dev->software |= 1 << x;
+			device_print(dev, "   %s is mixed into constant force\n", effect_names[x]);
+		} else if (used >= slots) {
+			device_print(dev, "   No slot left for %s\n", effect_names[x]);
+		}
+	}
+
+	device_print(dev, "   %d of %d effect slots used\n", used, slots);
+	output_unlock();
+}
+
+int effect_job(void *data)
+{
+	deviceJob *job = data;
+	unsigned int start = SDL_GetTicks();
+
+	create_device_effects(job->dev);
+	job->ms = SDL_GetTicks() - start;
+	return 0;
+}
+
+void create_effects(void)
+{
+	deviceJob *jobs;
+	SDL_Thread **threads;
+	unsigned int start = SDL_GetTicks();
+
+	if (num_devices == 0)
+		return;
+
+	jobs = calloc(num_devices, sizeof(deviceJob));
+	threads = calloc(num_devices, sizeof(SDL_Thread *));
+	if (!jobs || !threads) {
+		free(jobs);
+		free(threads);
+		for (int i = 0; i < num_devices; i++)
+			create_device_effects(&devices[i]);
+		return;
+	}
+
+	// Each thread has a device of its own. Remote devices go through the
+	// shared link and are done here, as are devices whose thread won't start.
+	for (int i = 0; i < num_devices; i++) {
+		jobs[i].dev = &devices[i];
+		devices[i].job = &jobs[i];
+		if (!devices[i].remote)
+			threads[i] = SDL_CreateThread(effect_job, "fg-haptic effects", &jobs[i]);
+		if (!threads[i])
+			effect_job(&jobs[i]);
+	}
+
+	for (int i = 0; i < num_devices; i++) {
+		if (threads[i])
+			SDL_WaitThread(threads[i], NULL);
+		devices[i].job = NULL;
+		fputs(jobs[i].report, stdout);
+		printf("   Effects ready in %u ms\n", jobs[i].ms);
+	}
+	printf("Effects of %d devices created in %u ms\n", num_devices, SDL_GetTicks() - start);
+
+	free(jobs);
+	free(threads);
+}
+
+/*
+ * Handles joystick hot-plug events. Effects are created only for new devices,
+ * the others keep running. Returns true if the device list has changed.
+ */
+bool handle_events(void)
+{
+	SDL_Event event;
+	bool changed = false;
+	int i;
+
+	while (SDL_PollEvent(&event)) {
+		switch (event.type) {
+		case SDL_JOYDEVICEADDED:
+			i = open_device(event.jdevice.which);
+			if (i >= 0) {
+				log_msg(LOG_INFO, "Device %d (%s) added", devices[i].num, devices[i].name);
+				create_device_effects(&devices[i]);
+				changed = true;
 			}
-			fgfswrite(telnet_sock, "get /haptic/device[%d]/stick-force/gain", i);
-			p = fgfsread(telnet_sock, READ_TIMEOUT);
-			if (p) {
-				read = sscanf(p, "%f", &fdata);
-				if (read == 1)
-					devices[i].stick_gain = fdata;
+			break;
+		case SDL_JOYDEVICEREMOVED:
+			for (i = 0; i < num_devices; i++) {
+				if (devices[i].instance == event.jdevice.which) {
+					log_msg(LOG_INFO, "Device %d (%s) removed", devices[i].num, devices[i].name);
+					if (remote.mode == REMOTE_SERVER)
+						remote_send_removed(&devices[i]);
+					close_device(i);
+					changed = true;
+					break;
+				}
 			}
+			break;
+		}
+	}
 
-			fgfswrite(telnet_sock, "get /haptic/device[%d]/ground-rumble/gain", i);
-			p = fgfsread(telnet_sock, READ_TIMEOUT);
-			if (p) {
-				read = sscanf(p, "%f", &fdata);
-				if (read == 1)
-					devices[i].rumble_gain = fdata;
-			}
+	return changed;
+}
+
+/*
+ * Sets all forces of a device to zero and stops the shaker, leaving effects
+ * uploaded.
+ */
+void neutral_device(hapticDevice * dev)
+{
+	forceFrame hold = { 0.0, 0.0, 0.0, false, false };
+
+	output_lock();
+	write_frame(dev, &hold);
+	memset(&dev->params, 0, sizeof(effectParams));
+	output_forces(dev, 0.0, 0.0, 0.0, false);
+	for (int x = GROUND_RUMBLE; x <= ENGINE_VIBRATION; x++)
+		if (has_periodic(dev, x))
+			output_periodic(dev, x, 0.0, 0.0);
+
+	// Friction is mechanical and stays, stiffness goes with the airflow
+	if (has_condition(dev, SPRING))
+		output_condition(dev, SPRING, 0.0);
+	if (has_condition(dev, DAMPER))
+		output_condition(dev, DAMPER, 0.0);
+	output_unlock();
+}
+
+/*
+ * Holds all devices driven by fg at neutral.
+ */
+void neutral_forces(fgInstance * fg)
+{
+	for (int i = 0; i < num_devices; i++)
+		if (devices[i].fg == fg)
+			neutral_device(&devices[i]);
+}
+
+/*
+ * True if a connection of fg has broken.
+ */
+bool fg_lost(fgInstance * fg)
+{
+	return fg->lost || fg->telnet.error || fg->generic.error;
+}
+
+/*
+ * Closes flightgear connections after an error and starts waiting again.
+ */
+void disconnect_fg(fgInstance * fg)
+{
+	log_msg(LOG_WARN, "Connection to flightgear instance %d lost, holding its devices at neutral", fg->num);
+
+	fgfsclose(&fg->telnet);
+	fgfsclose(&fg->generic);
+
+	neutral_forces(fg);
+	memset(&fg->new_params, 0, sizeof(effectParams));
+	fg->reconf_request = false;
+	fg->reconf = RECONF_IDLE;
+
+	fg->lost = false;
+	fg->warned = false;
+	fg->shaker = fg->pusher = false;
+	fg->accel_valid = false;
+	fg->turbulence = 0.0;
+	fg->predict.valid = false;
+	memset(&fg->timing, 0, sizeof(sampleTiming));
+	fg->idle = fg->busy = false;
+	fg->state = FG_WAITING;
+	fg->announced = 0;
+	log_msg(LOG_INFO, "Waiting for flightgear generic IO at port %d", fg->generic_port);
+}
+
+/*
+ * Opens telnet of an instance. Connecting blocks until the OS gives up on
+ * an unreachable host, so it's done by a thread of its own.
+ */
+int telnet_connect(void *data)
+{
+	fgInstance *fg = data;
+#ifndef _WIN32
+	sigset_t signals;
+
+	// Signals go to the update loop
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+#endif
+	fg->connect_sock = fgfsconnect(fg->host, fg->telnet_port, false);
+	SDL_AtomicSet(&fg->connected, 1);
+	return 0;
+}
+
+/*
+ * Returns the socket of a finished telnet connect, or NULL if it failed.
+ */
+TCPsocket telnet_result(fgInstance * fg)
+{
+	TCPsocket sock = fg->connect_sock;
+
+	if (fg->connector)
+		SDL_WaitThread(fg->connector, NULL);
+	fg->connector = NULL;
+	fg->connect_sock = NULL;
+	SDL_AtomicSet(&fg->connected, 0);
+	return sock;
+}
+
+/*
+ * Flightgear connection state machine. Generic IO is accepted and telnet
+ * opened without blocking the main loop, so devices and their effects stay
+ * open while flightgear restarts.
+ */
+void update_connection(fgInstance * fg, unsigned int now)
+{
+	const char *p;
+
+	if (fg_lost(fg))
+		disconnect_fg(fg);
+
+	switch (fg->state) {
+	case FG_WAITING:
+		// Connect finishing after the connection was lost
+		if (SDL_AtomicGet(&fg->connected)) {
+			TCPsocket sock = telnet_result(fg);
+			if (sock)
+				SDLNet_TCP_Close(sock);
 		}
 
-		if (devices[i].supported & SDL_HAPTIC_SINE) {
-			fgfswrite(telnet_sock, "get /haptic/device[%d]/stick-shaker/direction", i);
-			p = fgfsread(telnet_sock, READ_TIMEOUT);
-			if (p) {
-				read = sscanf(p, "%f", &fdata);
-				if (read == 1)
-					devices[i].shaker_dir = fdata;
-			}
-			fgfswrite(telnet_sock, "get /haptic/device[%d]/stick-shaker/period", i);
-			p = fgfsread(telnet_sock, READ_TIMEOUT);
-			if (p) {
-				read = sscanf(p, "%f", &fdata);
-				if (read == 1)
-					devices[i].shaker_period = fdata;
+		if (fgfsopen(&fg->generic, SDLNet_TCP_Accept(fg->server_sock)) != FGFS_OK)
+			break;
+
+		log_msg(LOG_INFO, "Got connection at port %d, sending haptic details through telnet at %s:%d",
+			fg->generic_port, fg->host, fg->telnet_port);
+		fg->accepted = fg->next_try = now;
+		fg->state = FG_TELNET;
+		break;
+
+	case FG_TELNET:
+		if (!fg->connector && !SDL_AtomicGet(&fg->connected)) {
+			if ((int)(now - fg->next_try) < 0)
+				break;
+			fg->connector = SDL_CreateThread(telnet_connect, "fg-haptic telnet", fg);
+			if (!fg->connector)
+				telnet_connect(fg);	// Blocks, but still connects
+		}
+		if (!SDL_AtomicGet(&fg->connected))
+			break;
+
+		// Flightgear may not have its telnet server up yet, keep trying for a while
+		if (fgfsopen(&fg->telnet, telnet_result(fg)) != FGFS_OK) {
+			if (now - fg->accepted > CONN_TIMEOUT * 1000) {
+				log_msg(LOG_ERROR, "Could not connect to flightgear with telnet!");
+				fg->lost = true;
 			}
-			fgfswrite(telnet_sock, "get /haptic/device[%d]/stick-shaker/gain", i);
-			p = fgfsread(telnet_sock, READ_TIMEOUT);
-			if (p) {
-				read = sscanf(p, "%f", &fdata);
-				if (read == 1)
-					devices[i].shaker_gain = fdata;
+			fg->next_try = now + TELNET_RETRY;
+			break;
+		}
+
+		// Switch to data mode
+		fgfswrite(&fg->telnet, "data");
+
+		// Devices get the settings of the aircraft before flightgear is told about them
+		fgfswrite(&fg->telnet, "get /sim/aircraft");
+		fg->next_try = now + TIMEOUT * 1000;
+		fg->state = FG_AIRCRAFT;
+		break;
+
+	case FG_AIRCRAFT:
+		// The reply is picked up in later rounds
+		p = fgfsreply(&fg->telnet);
+		if (!p && (int)(now - fg->next_try) < 0)
+			break;
+		load_aircraft_profiles(fg, p && *p ? p : NULL);
+
+		// send the devices to flightgear
+		send_devices(fg);
+
+		fg->state = FG_RUNNING;
+		fg->changed = now;
+		log_msg(LOG_INFO, "Flightgear instance %d running...", fg->num);
+		break;
+	}
+}
+
+/*
+ * Opens the generic IO port of every flightgear instance.
+ */
+void init_instances(void)
+{
+	for (int n = 0; n < num_instances; n++) {
+		fgInstance *fg = &instances[n];
+
+		// Listen for flightgear generic io, the connection is accepted in the main loop
+		fg->server_sock = fgfsconnect(DFLTHOST, fg->generic_port, true);
+		if (!fg->server_sock) {
+			printf("Failed to open generic IO port %d!\n", fg->generic_port);
+			abort_execution(-1);
+		}
+		printf("Waiting for flightgear generic IO at port %d\n", fg->generic_port);
+	}
+}
+
+/*
+ * Closes all connections of a flightgear instance.
+ */
+void close_instance(fgInstance * fg)
+{
+	// Close flightgear telnet connection
+	// Hand trim, shaker and pusher back to Nasal
+	fgfswrite(&fg->telnet, "set /haptic/native-logic 0");
+	fgfswrite(&fg->telnet, "quit");
+	fgfsclose(&fg->telnet);
+
+	// And generic
+	fgfsclose(&fg->generic);
+	if (fg->server_sock)
+		SDLNet_TCP_Close(fg->server_sock);
+	fg->server_sock = NULL;
+
+	free(fg->gets);
+	fg->gets = NULL;
+
+	// A connect still waiting for its host is left to finish on its own
+	if (fg->connector)
+		SDL_DetachThread(fg->connector);
+	fg->connector = NULL;
+}
+
+/*
+ * Parses a remote link description of form host:port[/udp|/tcp] for
+ * clients or port[/udp|/tcp] for servers.
+ */
+bool parse_remote(const char *spec, int mode)
+{
+	int len = 0;
+
+	memset(&remote, 0, sizeof(remoteLink));
+	remote.mode = mode;
+	remote.udp = true;
+
+	if (mode == REMOTE_CLIENT) {
+		if (sscanf(spec, "%30[^:]:%d%n", remote.host, &remote.port, &len) != 2)
+			return false;
+	} else if (sscanf(spec, "%d%n", &remote.port, &len) != 1)
+		return false;
+
+	spec += len;
+	if (strcmp(spec, "/tcp") == 0)
+		remote.udp = false;
+	else if (*spec != '\0' && strcmp(spec, "/udp") != 0)
+		return false;
+
+	return remote.port > 0 && remote.port < 65536;
+}
+
+/*
+ * Opens the remote link sockets. TCP clients connect later in remote_poll().
+ */
+void init_remote(void)
+{
+	IPaddress addr;
+
+	remote.socketset = SDLNet_AllocSocketSet(2);
+	remote.packet = SDLNet_AllocPacket(REMOTE_MAXPACKET);
+	if (!remote.socketset || !remote.packet) {
+		printf("Unable to create remote link: %s\n", SDLNet_GetError());
+		abort_execution(-1);
+	}
+
+	if (remote.udp) {
+		remote.udp_sock = SDLNet_UDP_Open(remote.mode == REMOTE_SERVER ? remote.port : 0);
+		if (!remote.udp_sock) {
+			printf("Unable to open UDP port %d: %s\n", remote.port, SDLNet_GetError());
+			abort_execution(-1);
+		}
+		SDLNet_UDP_AddSocket(remote.socketset, remote.udp_sock);
+
+		if (remote.mode == REMOTE_CLIENT) {
+			if (SDLNet_ResolveHost(&remote.peer, remote.host, remote.port) == -1) {
+				printf("Unable to resolve force server %s: %s\n", remote.host, SDLNet_GetError());
+				abort_execution(-1);
 			}
+			remote.have_peer = true;
+		}
+	} else if (remote.mode == REMOTE_SERVER) {
+		if (SDLNet_ResolveHost(&addr, NULL, remote.port) == -1
+		    || !(remote.tcp_server = SDLNet_TCP_Open(&addr))) {
+			printf("Unable to open TCP port %d: %s\n", remote.port, SDLNet_GetError());
+			abort_execution(-1);
+		}
+		SDLNet_TCP_AddSocket(remote.socketset, remote.tcp_server);
+	}
+
+	if (remote.mode == REMOTE_SERVER)
+		printf("Force server listening on %s port %d\n", remote.udp ? "UDP" : "TCP", remote.port);
+	else
+		printf("Using force server at %s:%d over %s\n", remote.host, remote.port, remote.udp ? "UDP" : "TCP");
+}
+
+void close_remote(void)
+{
+	if (remote.tcp_sock)
+		SDLNet_TCP_Close(remote.tcp_sock);
+	if (remote.tcp_server)
+		SDLNet_TCP_Close(remote.tcp_server);
+	if (remote.udp_sock)
+		SDLNet_UDP_Close(remote.udp_sock);
+	if (remote.packet)
+		SDLNet_FreePacket(remote.packet);
+	if (remote.socketset)
+		SDLNet_FreeSocketSet(remote.socketset);
+	memset(&remote, 0, sizeof(remoteLink));
+}
+
+/*
+ * Drops the TCP connection to the peer, it is reopened by remote_poll().
+ */
+void remote_drop(void)
+{
+	if (!remote.tcp_sock)
+		return;
+
+	log_msg(LOG_WARN, "Remote force link connection lost");
+	SDLNet_TCP_DelSocket(remote.socketset, remote.tcp_sock);
+	SDLNet_TCP_Close(remote.tcp_sock);
+	remote.tcp_sock = NULL;
+	remote.buflen = 0;
+	if (remote.mode == REMOTE_SERVER)
+		SDLNet_TCP_AddSocket(remote.socketset, remote.tcp_server);
+}
+
+void remote_send(Uint8 * data, int len)
+{
+	data[0] = REMOTE_MAGIC;
+	data[1] = REMOTE_VERSION;
+	data[3] = len;
+
+	if (remote.udp) {
+		if (!remote.have_peer)
+			return;
+		memcpy(remote.packet->data, data, len);
+		remote.packet->len = len;
+		remote.packet->address = remote.peer;
+		SDLNet_UDP_Send(remote.udp_sock, -1, remote.packet);
+	} else if (remote.tcp_sock) {
+		if (SDLNet_TCP_Send(remote.tcp_sock, data, len) < len)
+			remote_drop();
+	}
+}
+
+/*
+ * Forces are sent as 20 byte packets:
+ * 0 header, 4 device number, 6 sequence, 8 sender timestamp (ms),
+ * 12 x, 14 y, 16 z levels, 18 effect triggers
+ */
+void remote_send_forces(hapticDevice * dev, float x, float y, float z, bool shaker)
+{
+	Uint8 data[REMOTE_FORCE_LEN];
+
+	memset(data, 0, sizeof(data));
+	data[2] = REMOTE_FORCE;
+	SDLNet_Write16(dev->num, &data[4]);
+	SDLNet_Write16(remote.seq++, &data[6]);
+	SDLNet_Write32(SDL_GetTicks(), &data[8]);
+	SDLNet_Write16((Sint16) clamp(x, -32760.0, 32760.0), &data[12]);
+	SDLNet_Write16((Sint16) clamp(y, -32760.0, 32760.0), &data[14]);
+	SDLNet_Write16((Sint16) clamp(z, -32760.0, 32760.0), &data[16]);
+	SDLNet_Write16(shaker ? REMOTE_TRIG_SHAKER : 0, &data[18]);
+
+	remote_send(data, REMOTE_FORCE_LEN);
+}
+
+/*
+ * Device descriptions:
+ * 0 header, 4 device number, 6 effects, 8 effects playing, 10 axes,
+ * 11 reserved, 12 supported, 16 name
+ */
+void remote_send_device(hapticDevice * dev)
+{
+	Uint8 data[REMOTE_DEVICE_LEN];
+
+	memset(data, 0, sizeof(data));
+	data[2] = REMOTE_DEVICE;
+	SDLNet_Write16(dev->num, &data[4]);
+	data[10] = dev->axes;
+	SDLNet_Write16(dev->numEffects, &data[6]);
+	SDLNet_Write16(dev->numEffectsPlaying, &data[8]);
+	SDLNet_Write32(dev->supported, &data[12]);
+	memcpy(&data[16], dev->name, NAMELEN);
+
+	remote_send(data, REMOTE_DEVICE_LEN);
+}
+
+/*
+ * Settings applied on the device side:
+ * 0 header, 4 device number, 6 autocenter, 8 gain (1/1000),
+ * 10 shaker direction, 12 shaker period, 14 shaker gain (1/1000)
+ */
+void remote_send_config(hapticDevice * dev)
+{
+	Uint8 data[REMOTE_CONFIG_LEN];
+
+	memset(data, 0, sizeof(data));
+	data[2] = REMOTE_CONFIG;
+	SDLNet_Write16(dev->num, &data[4]);
+	SDLNet_Write16(clamp(dev->autocenter, 0.0, 1.0) * 1000, &data[6]);
+	SDLNet_Write16(clamp(dev->gain, 0.0, 1.0) * 1000, &data[8]);
+	SDLNet_Write16(dev->shaker_dir, &data[10]);
+	SDLNet_Write16(dev->shaker_period, &data[12]);
+	SDLNet_Write16(clamp(dev->shaker_gain, 0.0, 60.0) * 1000, &data[14]);
+
+	remote_send(data, REMOTE_CONFIG_LEN);
+}
+
+/*
+ * Periodic effect changes, sent only when they change:
+ * 0 header, 4 device number, 6 effect, 7 reserved, 8 period (ms, 0 = stop),
+ * 10 magnitude
+ */
+void remote_send_periodic(hapticDevice * dev, int effect, Uint16 period, Sint16 magnitude)
+{
+	Uint8 data[REMOTE_PERIODIC_LEN];
+
+	memset(data, 0, sizeof(data));
+	data[2] = REMOTE_PERIODIC;
+	SDLNet_Write16(dev->num, &data[4]);
+	data[6] = effect;
+	SDLNet_Write16(period, &data[8]);
+	SDLNet_Write16(magnitude, &data[10]);
+
+	remote_send(data, REMOTE_PERIODIC_LEN);
+}
+
+/*
+ * Condition effect changes, sent only when they change:
+ * 0 header, 4 device number, 6 effect, 7 reserved, 8 coefficient
+ */
+void remote_send_condition(hapticDevice * dev, int effect, Sint16 coeff)
+{
+	Uint8 data[REMOTE_CONDITION_LEN];
+
+	memset(data, 0, sizeof(data));
+	data[2] = REMOTE_CONDITION;
+	SDLNet_Write16(dev->num, &data[4]);
+	data[6] = effect;
+	SDLNet_Write16(coeff, &data[8]);
+
+	remote_send(data, REMOTE_CONDITION_LEN);
+}
+
+void remote_send_devices(void)
+{
+	for (int i = 0; i < num_devices; i++)
+		remote_send_device(&devices[i]);
+}
+
+void remote_send_removed(hapticDevice * dev)
+{
+	Uint8 data[REMOTE_HEADER_LEN + 4];
+
+	memset(data, 0, sizeof(data));
+	data[2] = REMOTE_REMOVED;
+	SDLNet_Write16(dev->num, &data[4]);
+	remote_send(data, sizeof(data));
+}
+
+hapticDevice *find_device(unsigned int num)
+{
+	for (int i = 0; i < num_devices; i++)
+		if (devices[i].num == num)
+			return &devices[i];
+	return NULL;
+}
+
+/*
+ * Creates or updates the local stand-in of a remote device.
+ */
+void remote_add_device(const Uint8 * data)
+{
+	hapticDevice *dev = find_device(SDLNet_Read16(&data[4]));
+	bool added = false;
+
+	if (!dev) {
+		dev = append_device();
+		dev->remote = true;
+		dev->open = true;
+		dev->instance = -1;	// Never matches hot-plug events
+		dev->num = SDLNet_Read16(&data[4]);
+		added = true;
+	}
+
+	dev->axes = data[10] > AXES ? AXES : data[10];
+	dev->numEffects = SDLNet_Read16(&data[6]);
+	dev->numEffectsPlaying = SDLNet_Read16(&data[8]);
+	dev->supported = SDLNet_Read32(&data[12]);
+	memcpy(dev->name, &data[16], NAMELEN);
+	dev->name[NAMELEN] = '\0';
+
+	if (!added)
+		return;
+
+	log_msg(LOG_INFO, "Remote device %d name is %s", dev->num, dev->name);
+	default_device_params(dev);
+	load_profile(dev, NULL, PROFILE_SETTINGS);
+	route_device(dev);
+	add_device();
+	create_device_effects(dev);
+
+	for (int n = 0; n < num_instances; n++)
+		if (instances[n].state == FG_RUNNING)
+			send_devices(&instances[n]);
+}
+
+void remote_update_stats(const Uint8 * data, unsigned int now)
+{
+	Uint16 seq = SDLNet_Read16(&data[6]);
+
+	if (remote.mode == REMOTE_CLIENT) {
+		unsigned int rtt = now - SDLNet_Read32(&data[8]);
+
+		if (remote.rtt_count == 0 || rtt < remote.rtt_min)
+			remote.rtt_min = rtt;
+		if (rtt > remote.rtt_max)
+			remote.rtt_max = rtt;
+		remote.rtt_sum += rtt;
+		remote.rtt_count++;
+		remote.rtt_avg = remote.rtt_avg > 0.0 ? remote.rtt_avg * 0.9 + rtt * 0.1 : rtt;
+		return;
+	}
+
+	if (remote.have_seq && seq != (Uint16) (remote.rx_seq + 1))
+		remote.lost += (Uint16) (seq - remote.rx_seq - 1);
+	if (remote.have_seq && now - remote.last_rx > remote.max_gap)
+		remote.max_gap = now - remote.last_rx;
+	remote.rx_seq = seq;
+	remote.have_seq = true;
+	remote.packets++;
+}
+
+void remote_handle(Uint8 * data, int len, unsigned int now)
+{
+	hapticDevice *dev;
+
+	if (len < REMOTE_HEADER_LEN || data[0] != REMOTE_MAGIC || data[3] != len)
+		return;
+	if (data[1] != REMOTE_VERSION) {
+		log_msg(LOG_ERROR, "Remote force link version %d not supported", data[1]);
+		return;
+	}
+
+	switch (data[2]) {
+	case REMOTE_HELLO:
+		if (remote.mode == REMOTE_SERVER)
+			remote_send_devices();
+		break;
+
+	case REMOTE_DEVICE:
+		if (remote.mode == REMOTE_CLIENT && len == REMOTE_DEVICE_LEN)
+			remote_add_device(data);
+		break;
+
+	case REMOTE_REMOVED:
+		if (remote.mode == REMOTE_CLIENT && (dev = find_device(SDLNet_Read16(&data[4]))) && dev->remote) {
+			log_msg(LOG_INFO, "Remote device %d (%s) removed", dev->num, dev->name);
+			close_device(dev - devices);
+			for (int n = 0; n < num_instances; n++)
+				if (instances[n].state == FG_RUNNING)
+					send_devices(&instances[n]);
+		}
+		break;
+
+	case REMOTE_FORCE:
+		if (remote.mode != REMOTE_SERVER || len != REMOTE_FORCE_LEN)
+			break;
+
+		remote_update_stats(data, now);
+		remote.last_rx = now;
+		dev = find_device(SDLNet_Read16(&data[4]));
+		if (dev && !hold_neutral)
+			output_forces(dev, (Sint16) SDLNet_Read16(&data[12]), (Sint16) SDLNet_Read16(&data[14]),
+				      (Sint16) SDLNet_Read16(&data[16]), SDLNet_Read16(&data[18]) & REMOTE_TRIG_SHAKER);
+
+		// Return some packets for the client to measure round trip time
+		if (SDLNet_Read16(&data[6]) % REMOTE_ECHO_EVERY == 0) {
+			data[2] = REMOTE_ECHO;
+			remote_send(data, REMOTE_FORCE_LEN);
+		}
+		break;
+
+	case REMOTE_CONFIG:
+		if (remote.mode != REMOTE_SERVER || len != REMOTE_CONFIG_LEN
+		    || !(dev = find_device(SDLNet_Read16(&data[4]))))
+			break;
+
+		dev->autocenter = SDLNet_Read16(&data[6]) / 1000.0;
+		dev->gain = SDLNet_Read16(&data[8]) / 1000.0;
+		dev->shaker_dir = SDLNet_Read16(&data[10]);
+		dev->shaker_period = SDLNet_Read16(&data[12]);
+		dev->shaker_gain = SDLNet_Read16(&data[14]) / 1000.0;
+		create_device_effects(dev);
+		break;
+
+	case REMOTE_PERIODIC:
+		if (remote.mode != REMOTE_SERVER || len != REMOTE_PERIODIC_LEN
+		    || !(dev = find_device(SDLNet_Read16(&data[4]))))
+			break;
+		if ((data[6] == GROUND_RUMBLE || data[6] == ENGINE_VIBRATION) && has_periodic(dev, data[6]) && !hold_neutral)
+			output_periodic(dev, data[6], SDLNet_Read16(&data[8]), (Sint16) SDLNet_Read16(&data[10]));
+		break;
+
+	case REMOTE_CONDITION:
+		if (remote.mode != REMOTE_SERVER || len != REMOTE_CONDITION_LEN
+		    || !(dev = find_device(SDLNet_Read16(&data[4]))))
+			break;
+		if (condition_type(data[6]) && dev->effectId[data[6]] != -1 && !hold_neutral)
+			output_condition(dev, data[6], (Sint16) SDLNet_Read16(&data[8]));
+		break;
+
+	case REMOTE_ECHO:
+		if (remote.mode == REMOTE_CLIENT && len == REMOTE_FORCE_LEN) {
+			remote_update_stats(data, now);
+			remote.last_rx = now;
+		}
+		break;
+	}
+}
+
+/*
+ * Locks a UDP server to one client. Another client is taken only once the
+ * current one has been quiet for REMOTE_TIMEOUT, and only with a packet of
+ * our link version. Returns false for packets to ignore.
+ */
+bool remote_accept_peer(UDPpacket * p, unsigned int now)
+{
+	Uint8 *ip = (Uint8 *) & p->address.host;
+
+	if (remote.have_peer && p->address.host == remote.peer.host && p->address.port == remote.peer.port) {
+		remote.peer_rx = now;
+		return true;
+	}
+	if (remote.have_peer && now - remote.peer_rx < REMOTE_TIMEOUT)
+		return false;
+	if (p->len < REMOTE_HEADER_LEN || p->data[0] != REMOTE_MAGIC)
+		return false;
+	if (p->data[1] != REMOTE_VERSION) {
+		log_msg(LOG_ERROR, "Remote force link version %d not supported", p->data[1]);
+		return false;
+	}
+
+	log_msg(LOG_INFO, "Remote force client at %d.%d.%d.%d:%d", ip[0], ip[1], ip[2], ip[3],
+		SDLNet_Read16(&p->address.port));
+	remote.peer = p->address;
+	remote.have_peer = true;
+	remote.peer_rx = now;
+	remote.have_seq = false;	// The new client counts its own sequence
+	return true;
+}
+
+/*
+ * Services the remote link: accepts and reconnects TCP, asks the server for
+ * its devices, handles received packets and reports link statistics.
+ * Waits at most timeout ms for packets.
+ */
+void remote_poll(unsigned int now, unsigned int timeout)
+{
+	Uint8 hello[REMOTE_HEADER_LEN];
+	IPaddress addr;
+	int len;
+
+	if (!remote.udp && !remote.tcp_sock) {
+		if (remote.mode == REMOTE_SERVER) {
+			remote.tcp_sock = SDLNet_TCP_Accept(remote.tcp_server);
+		} else if ((int)(now - remote.next_try) >= 0) {
+			remote.next_try = now + REMOTE_RETRY;
+			if (SDLNet_ResolveHost(&addr, remote.host, remote.port) != -1)
+				remote.tcp_sock = SDLNet_TCP_Open(&addr);
+		}
+		if (remote.tcp_sock) {
+			log_msg(LOG_INFO, "Remote force link connected");
+			if (remote.mode == REMOTE_SERVER)
+				SDLNet_TCP_DelSocket(remote.socketset, remote.tcp_server);	// One client at a time
+			SDLNet_TCP_AddSocket(remote.socketset, remote.tcp_sock);
+			remote.next_try = now;	// Say hello right away
+		}
+	}
+	// Clients ask for devices until the server answers
+	if (remote.mode == REMOTE_CLIENT && (int)(now - remote.next_try) >= 0
+	    && (now - remote.last_rx > REMOTE_RETRY || remote.last_rx == 0)) {
+		memset(hello, 0, sizeof(hello));
+		hello[2] = REMOTE_HELLO;
+		remote_send(hello, sizeof(hello));
+		remote.next_try = now + REMOTE_RETRY;
+	}
+
+	while (SDLNet_CheckSockets(remote.socketset, timeout) > 0) {
+		timeout = 0;
+		if (remote.udp) {
+			while (SDLNet_UDP_Recv(remote.udp_sock, remote.packet) > 0) {
+				if (remote.mode == REMOTE_SERVER && !remote_accept_peer(remote.packet, now))
+					continue;
+				remote_handle(remote.packet->data, remote.packet->len, now);
+			}
+			break;
+		}
+
+		if (!SDLNet_SocketReady(remote.tcp_sock))
+			break;	// Only a pending connection, accepted next round
+
+		len = SDLNet_TCP_Recv(remote.tcp_sock, &remote.buf[remote.buflen], REMOTE_MAXPACKET - remote.buflen);
+		if (len <= 0) {
+			remote_drop();
+			break;
+		}
+		remote.buflen += len;
+
+		// Split the stream into packets
+		while (remote.buflen >= REMOTE_HEADER_LEN && remote.buflen >= remote.buf[3]) {
+			len = remote.buf[3];
+			if (len < REMOTE_HEADER_LEN || remote.buf[0] != REMOTE_MAGIC) {
+				remote_drop();
+				break;
+			}
+			remote_handle(remote.buf, len, now);
+			remote.buflen -= len;
+			memmove(remote.buf, &remote.buf[len], remote.buflen);
+		}
+	}
+
+	if ((int)(now - remote.next_report) >= 0) {
+		if (remote.mode == REMOTE_CLIENT && remote.rtt_count)
+			log_msg(LOG_INFO, "Remote force link: round trip min %u avg %u max %u ms",
+				remote.rtt_min, remote.rtt_sum / remote.rtt_count, remote.rtt_max);
+		else if (remote.mode == REMOTE_SERVER && remote.packets)
+			log_msg(LOG_INFO, "Remote force link: %u packets, %u lost, max gap %u ms",
+				remote.packets, remote.lost, remote.max_gap);
+		remote.rtt_min = remote.rtt_max = remote.rtt_sum = remote.rtt_count = 0;
+		remote.packets = remote.lost = remote.max_gap = 0;
+		remote.next_report = now + REMOTE_REPORT;
+	}
+}
+
+/*
+ * Main loop of the device side of a remote force link. Forces come from the
+ * client, devices are held at neutral if it goes quiet.
+ */
+void remote_server_loop(void)
+{
+	unsigned int now;
+	bool neutral = true;
+
+	logger.loop = true;
+	while (!quit) {
+		now = SDL_GetTicks();
+
+		if (handle_events())
+			remote_send_devices();
+
+		remote_poll(now, 10);
+		control_poll(now);
+
+		if (!neutral && now - remote.last_rx > REMOTE_TIMEOUT) {
+			log_msg(LOG_WARN, "No forces from remote client, holding devices at neutral");
+			for (int i = 0; i < num_devices; i++)
+				neutral_device(&devices[i]);
+		}
+		neutral = now - remote.last_rx > REMOTE_TIMEOUT;
+	}
+}
+
+/*
+ * Position of a device among the devices of its flightgear instance, as
+ * in /haptic/device[n]. -1 if it has no instance.
+ */
+int fg_device_index(hapticDevice * dev)
+{
+	int n = 0;
+
+	if (!dev->fg)
+		return -1;
+	for (int i = 0; i < num_devices; i++) {
+		if (&devices[i] == dev)
+			return n;
+		if (devices[i].fg == dev->fg)
+			n++;
+	}
+	return -1;
+}
+
+/*
+ * Applies a setting changed through the control socket without recreating
+ * effects. Gains are read by the update loop as it runs, only device gain
+ * and autocenter are pushed to the device. Flightgear gets the new value
+ * too, or it would restore its own at the next reconfigure.
+ */
+void apply_setting(hapticDevice * dev, int k)
+{
+	size_t offset = profile_floats[k].offset;
+	float value = *(float *)((char *)dev + offset);
+	int n = fg_device_index(dev);
+
+	build_mix(dev);
+
+	if (offset == offsetof(hapticDevice, gain) || offset == offsetof(hapticDevice, autocenter)) {
+		if (dev->remote)
+			remote_send_config(dev);
+		else if (offset == offsetof(hapticDevice, gain) && (dev->supported & SDL_HAPTIC_GAIN))
+			SDL_HapticSetGain(dev->device, dev->gain * 100);
+		else if (offset == offsetof(hapticDevice, autocenter) && (dev->supported & SDL_HAPTIC_AUTOCENTER))
+			SDL_HapticSetAutocenter(dev->device, dev->autocenter * 100);
+	}
+
+	if (n >= 0 && dev->fg->state == FG_RUNNING && !fg_lost(dev->fg))
+		fgfswrite(&dev->fg->telnet, "set /haptic/device[%d]/%s %f", n, profile_floats[k].node, value);
+}
+
+#ifndef _WIN32
+void control_close_client(controlClient * c)
+{
+	close(c->fd);
+	c->fd = -1;
+	c->inlen = 0;
+}
+
+/*
+ * Sends one reply line. Clients that don't keep up with replies are dropped.
+ */
+void control_reply(controlClient * c, const char *msg, ...)
+{
+	char line[MAXMSG];
+	va_list vl;
+	int len;
+
+	if (c->fd < 0)
+		return;
+
+	va_start(vl, msg);
+	len = vsnprintf(line, sizeof(line) - 1, msg, vl);
+	va_end(vl);
+	if (len < 0)
+		return;
+	if (len > sizeof(line) - 2)
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+
+	if (send(c->fd, line, len, MSG_DONTWAIT) != len)
+		control_close_client(c);
+}
+
+void control_command(controlClient * c, char *line, unsigned int now)
+{
+	char *cmd = strtok(line, " \t\r");
+	char *arg[3];
+	hapticDevice *dev = NULL;
+	int k;
+
+	if (!cmd)
+		return;
+	for (k = 0; k < 3; k++)
+		arg[k] = strtok(NULL, " \t\r");
+	if ((strcmp(cmd, "get") == 0 || strcmp(cmd, "set") == 0)
+	    && (!arg[0] || !(dev = find_device(atoi(arg[0]))))) {
+		control_reply(c, "error no such device");
+		return;
+	}
+
+	if (strcmp(cmd, "help") == 0) {
+		control_reply(c, "devices : List devices");
+		control_reply(c, "get device [setting] : Show settings of a device");
+		control_reply(c, "set device setting value : Change a setting, effects keep running");
+		control_reply(c, "neutral on|off : Hold all devices at neutral");
+		control_reply(c, "stats : Show connection and update loop statistics");
+		control_reply(c, "log [level] : Show log counters, or write messages up to error, warn, info or debug");
+	} else if (strcmp(cmd, "devices") == 0) {
+		for (int i = 0; i < num_devices; i++)
+			control_reply(c, "device %d instance %d axes %d supported 0x%x%s %s", devices[i].num,
+				      devices[i].fg ? devices[i].fg->num : 0, devices[i].axes, devices[i].supported,
+				      devices[i].remote ? " remote" : "", devices[i].name);
+	} else if (strcmp(cmd, "get") == 0) {
+		for (k = 0; k < PROFILE_FLOATS; k++)
+			if (!arg[1] || strcmp(arg[1], profile_floats[k].key) == 0)
+				control_reply(c, "%s %f", profile_floats[k].key,
+					      *(float *)((char *)dev + profile_floats[k].offset));
+	} else if (strcmp(cmd, "set") == 0) {
+		for (k = 0; k < PROFILE_FLOATS && arg[1]; k++)
+			if (strcmp(arg[1], profile_floats[k].key) == 0)
+				break;
+		if (k == PROFILE_FLOATS || !arg[1] || !arg[2]) {
+			control_reply(c, "error usage: set device setting value");
+			return;
+		}
+
+		char *end;
+		float value = strtof(arg[2], &end);
+
+		if (end == arg[2] || *end != '\0' || !isfinite(value)) {
+			control_reply(c, "error %s is not a number", arg[2]);
+			return;
+		}
+
+		// Out of range values are clamped, the reply tells what was set
+		value = clamp(value, profile_floats[k].min, profile_floats[k].max);
+		*(float *)((char *)dev + profile_floats[k].offset) = value;
+		apply_setting(dev, k);
+		wake_instances();
+		control_reply(c, "%s %f", profile_floats[k].key, value);
+		log_msg(LOG_INFO, "Control: device %d %s set to %f", dev->num, profile_floats[k].key, value);
+	} else if (strcmp(cmd, "neutral") == 0) {
+		if (!arg[0] || (strcmp(arg[0], "on") != 0 && strcmp(arg[0], "off") != 0)) {
+			control_reply(c, "error usage: neutral on|off");
+			return;
+		}
+		hold_neutral = strcmp(arg[0], "on") == 0;
+		wake_instances();
+		if (hold_neutral)
+			for (int i = 0; i < num_devices; i++)
+				if (devices[i].open)
+					neutral_device(&devices[i]);
+		log_msg(LOG_INFO, "Control: %s", hold_neutral ? "holding devices at neutral" : "releasing devices");
+	} else if (strcmp(cmd, "log") == 0) {
+		if (arg[0] && log_level(arg[0]) < 0) {
+			control_reply(c, "error usage: log [error|warn|info|debug]");
+			return;
+		}
+		if (arg[0])
+			SDL_AtomicSet(&logger.level, log_level(arg[0]));
+		control_reply(c, "log %s written %d suppressed %d", log_levels[SDL_AtomicGet(&logger.level)],
+			      SDL_AtomicGet(&logger.written), SDL_AtomicGet(&logger.suppressed));
+	} else if (strcmp(cmd, "stats") == 0) {
+		unsigned int span = now - control.since;
+
+		control_reply(c, "uptime %u", now / 1000);
+		control_reply(c, "loop-rate %.1f", span ? control.loops * 1000.0 / span : 0.0);
+		control_reply(c, "max-loop-interval %u", control.max_dt);
+		control_reply(c, "neutral %d", hold_neutral);
+		for (int n = 0; n < num_instances; n++)
+			control_reply(c, "instance %d %s turbulence %.2f aircraft %s", instances[n].num,
+				      instances[n].idle ? "idle" : instances[n].state == FG_RUNNING ? "running" :
+				      instances[n].state != FG_WAITING ? "connecting" : "waiting",
+				      instances[n].turbulence, instances[n].aircraft[0] ? instances[n].aircraft : "-");
+		for (int n = 0; n < num_instances; n++) {
+			sampleTiming *t = &instances[n].timing;
+
+			if (t->valid)
+				control_reply(c, "instance %d samples %u age-avg %.1f age-max %.1f stale %u lost %u repeated %u",
+					      instances[n].num, t->samples, t->samples ? t->age_sum / t->samples : 0.0,
+					      t->age_max, t->stale, t->gaps, t->repeats);
+		}
+		if (remote.mode != REMOTE_NONE)
+			control_reply(c, "remote packets %u lost %u", remote.packets, remote.lost);
+		if (rt.enabled)
+			control_reply(c, "deadline-misses %u worst-late-us %ld output-skipped %u", rt.misses, rt.worst,
+				      output.skipped);
+		control_reply(c, "log-written %d log-suppressed %d", SDL_AtomicGet(&logger.written),
+			      SDL_AtomicGet(&logger.suppressed));
+		control.since = now;
+		control.loops = control.max_dt = 0;
+	} else {
+		control_reply(c, "error unknown command, try help");
+		return;
+	}
+	control_reply(c, "ok");
+}
+
+/*
+ * Opens the control socket. A socket left behind by an earlier run is
+ * removed first, anything else at the path is left alone.
+ */
+void init_control(void)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+
+	for (int k = 0; k < MAX_CONTROL; k++)
+		control.client[k].fd = -1;
+	if (!control.path[0])
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(control.path) >= sizeof(addr.sun_path)) {
+		printf("Control socket path too long: %s\n", control.path);
+		return;
+	}
+	strcpy(addr.sun_path, control.path);
+	if (stat(control.path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(control.path);
+
+	control.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (control.fd < 0 || bind(control.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || listen(control.fd, MAX_CONTROL) < 0 || fcntl(control.fd, F_SETFL, O_NONBLOCK) < 0) {
+		printf("Unable to open control socket %s: %s\n", control.path, strerror(errno));
+		if (control.fd >= 0)
+			close(control.fd);
+		control.fd = -1;
+		return;
+	}
+	control.since = SDL_GetTicks();
+	printf("Control socket at %s\n", control.path);
+}
+
+void close_control(void)
+{
+	if (control.fd < 0)
+		return;
+	for (int k = 0; k < MAX_CONTROL; k++)
+		if (control.client[k].fd >= 0)
+			control_close_client(&control.client[k]);
+	close(control.fd);
+	control.fd = -1;
+	unlink(control.path);
+}
+
+/*
+ * Accepts control clients and runs their commands, without blocking.
+ */
+void control_poll(unsigned int now)
+{
+	controlClient *c;
+	char *nl;
+	int fd, k, len;
+
+	if (control.fd < 0)
+		return;
+
+	while ((fd = accept(control.fd, NULL, NULL)) >= 0) {
+		for (k = 0; k < MAX_CONTROL && control.client[k].fd >= 0; k++) ;
+		if (k == MAX_CONTROL) {
+			close(fd);
+			continue;
+		}
+		control.client[k].fd = fd;
+		control.client[k].inlen = 0;
+	}
+
+	for (k = 0; k < MAX_CONTROL; k++) {
+		c = &control.client[k];
+		if (c->fd < 0)
+			continue;
+
+		len = recv(c->fd, c->in + c->inlen, MAXMSG - 1 - c->inlen, MSG_DONTWAIT);
+		if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			control_close_client(c);
+			continue;
+		}
+		if (len < 0)
+			continue;
+		c->inlen += len;
+		c->in[c->inlen] = '\0';
+
+		while (c->fd >= 0 && (nl = strchr(c->in, '\n'))) {
+			*nl = '\0';
+			control_command(c, c->in, now);
+			c->inlen -= nl + 1 - c->in;
+			memmove(c->in, nl + 1, c->inlen + 1);
+		}
+		if (c->inlen >= MAXMSG - 1) {
+			control_reply(c, "error line too long");
+			c->inlen = 0;
+		}
+	}
+}
+#else
+void init_control(void)
+{
+	if (control.path[0])
+		printf("Control socket is not available on this platform\n");
+}
+
+void close_control(void)
+{
+}
+
+void control_poll(unsigned int now)
+{
+}
+#endif
+
+#ifndef _WIN32
+/*
+ * Touches a stack area, so it is mapped before memory is locked and the
+ * loop won't page fault into it later.
+ */
+void rt_prefault(void)
+{
+	volatile char stack[RT_PREFAULT];
+
+	memset((char *)stack, 0, sizeof(stack));
+}
+
+/*
+ * Moves the calling thread into real-time mode. Every step may fail
+ * without privileges, the thread then runs with what could be had.
+ */
+void rt_enter(void)
+{
+	struct sched_param sp;
+	int err;
+
+	rt_prefault();
+
+#ifdef __linux__
+	if (rt.cpu >= 0) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(rt.cpu, &cpus);
+		if ((err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) != 0)
+			printf("Unable to run on CPU %d: %s\n", rt.cpu, strerror(err));
+	}
+#endif
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = RT_PRIORITY;
+	if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)) != 0) {
+		printf("Real-time priority not available (%s), using high thread priority\n", strerror(err));
+		SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+	} else {
+		printf("Real-time mode, SCHED_FIFO priority %d\n", RT_PRIORITY);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &rt.next);
+	rt.next_report = SDL_GetTicks() + RT_REPORT;
+}
+
+/*
+ * Starts the deadlines over from now, after the loop has waited otherwise.
+ */
+void rt_resync(void)
+{
+	if (rt.enabled)
+		clock_gettime(CLOCK_MONOTONIC, &rt.next);
+}
+
+/*
+ * Sleeps until the next period. In real-time mode the deadline is
+ * absolute, late wake-ups are counted and reported.
+ */
+void rt_wait(void)
+{
+	struct timespec now;
+	long late;
+
+	if (!rt.enabled) {
+		SDL_Delay(LOOP_PERIOD);
+		return;
+	}
+
+	rt.next.tv_nsec += LOOP_PERIOD * 1000000L;
+	if (rt.next.tv_nsec >= 1000000000L) {
+		rt.next.tv_nsec -= 1000000000L;
+		rt.next.tv_sec++;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &rt.next, NULL) == EINTR) ;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late = (now.tv_sec - rt.next.tv_sec) * 1000000L + (now.tv_nsec - rt.next.tv_nsec) / 1000;
+	if (late > RT_MISS_US) {
+		rt.misses++;
+		if (late > rt.worst)
+			rt.worst = late;
+		// Don't rush through missed periods to catch up
+		if (late > LOOP_PERIOD * 1000L)
+			rt.next = now;
+	}
+
+	if (SDL_GetTicks() >= rt.next_report) {
+		if (rt.misses != rt.reported)
+			log_msg(LOG_WARN, "%s missed %u deadlines, worst %.1f ms late",
+				output.thread ? "Output thread" : "Update loop", rt.misses - rt.reported,
+				rt.worst / 1000.0);
+		rt.reported = rt.misses;
+		rt.next_report = SDL_GetTicks() + RT_REPORT;
+	}
+}
+
+/*
+ * Sends the latest levels of every local device once a period. Sleeps
+ * while the loop holds all of them.
+ */
+int output_thread(void *data)
+{
+	sigset_t signals;
+
+	// Signals go to the update loop, which stops this thread on the way out
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	rt_enter();
+
+	while (!SDL_AtomicGet(&output.stop)) {
+		bool active = true;
+
+		if (SDL_TryLockMutex(output.lock) == 0) {
+			active = false;
+			for (int i = 0; i < num_devices; i++) {
+				forceFrame f;
+
+				if (devices[i].remote || !devices[i].device || !devices[i].open)
+					continue;
+				read_frame(&devices[i], &f);
+				if (!f.active)
+					continue;
+				output_forces(&devices[i], f.x, f.y, f.z, f.shaker);
+				active = true;
+			}
+			SDL_UnlockMutex(output.lock);
+		} else {
+			output.skipped++;
+		}
+
+		if (active) {
+			rt_wait();
+		} else {
+			SDL_AtomicSet(&output.sleeping, 1);
+			SDL_SemWaitTimeout(output.wake, IDLE_PERIOD);
+			SDL_AtomicSet(&output.sleeping, 0);
+			rt_resync();
+		}
+	}
+	return 0;
+}
+
+/*
+ * Locks memory and starts the output thread in real-time mode. The update
+ * loop stays at normal priority, except for a remote force server, whose
+ * loop applies forces as they arrive.
+ */
+void init_realtime(void)
+{
+	if (!rt.enabled)
+		return;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		printf("Unable to lock memory: %s\n", strerror(errno));
+
+	if (remote.mode != REMOTE_SERVER) {
+		output.lock = SDL_CreateMutex();
+		output.wake = SDL_CreateSemaphore(0);
+		if (output.lock && output.wake)
+			output.thread = SDL_CreateThread(output_thread, "fg-haptic output", NULL);
+		if (output.thread)
+			return;
+
+		printf("Unable to start output thread: %s, running the update loop in real-time mode\n", SDL_GetError());
+		if (output.lock)
+			SDL_DestroyMutex(output.lock);
+		if (output.wake)
+			SDL_DestroySemaphore(output.wake);
+		output.lock = NULL;
+		output.wake = NULL;
+	}
+	rt_enter();
+}
+
+/*
+ * Stops the output thread, the loop sends forces itself from then on.
+ */
+void close_realtime(void)
+{
+	if (!output.thread)
+		return;
+
+	SDL_AtomicSet(&output.stop, 1);
+	SDL_SemPost(output.wake);
+	SDL_WaitThread(output.thread, NULL);
+	output.thread = NULL;
+	SDL_DestroyMutex(output.lock);
+	SDL_DestroySemaphore(output.wake);
+	output.lock = NULL;
+	output.wake = NULL;
+}
+#else
+void init_realtime(void)
+{
+	if (rt.enabled)
+		printf("Real-time mode is not available on this platform\n");
+	rt.enabled = false;
+}
+
+void close_realtime(void)
+{
+}
+
+void rt_resync(void)
+{
+}
+
+void rt_wait(void)
+{
+	SDL_Delay(LOOP_PERIOD);
+}
+#endif
+
+/*
+ * Uploads changed effect parameters. Returns false if the device refused them.
+ */
+bool reload_effect(hapticDevice * device, SDL_HapticEffect * effect, int *effectId, bool run)
+{
+	if (!device->device || !device->open)
+		return true;
+
+	if (SDL_HapticUpdateEffect(device->device, *effectId, effect) < 0) {
+		log_msg(LOG_ERROR, "Update error on device %d: %s", device->num, SDL_GetError());
+		return false;
+	}
+	if (run)
+		if (SDL_HapticRunEffect(device->device, *effectId, 1) < 0)
+			log_msg(LOG_ERROR, "Run error on device %d: %s", device->num, SDL_GetError());
+	return true;
+}
+
+/*
+ * Square wave level of effects mixed in software, sampled at the update rate.
+ */
+float software_level(hapticDevice * dev, unsigned int now, bool shaker)
+{
+	float level = 0.0;
+
+	for (int x = GROUND_RUMBLE; x <= ENGINE_VIBRATION; x++) {
+		SDL_HapticPeriodic *p = &dev->effect[x].periodic;
+
+		if ((dev->software & dev->periodic_on & (1 << x)) && p->period > 0)
+			level += (now % p->period) < p->period / 2 ? p->magnitude : -p->magnitude;
+	}
+
+	if ((dev->software & (1 << STICK_SHAKER)) && shaker && dev->shaker_period > 0)
+		level += dev->shaker_gain * ((now % dev->shaker_period) < dev->shaker_period / 2 ? 0x4000 : -0x4000);
+
+	return level;
+}
+
+/*
+ * Streams the next STREAM_SAMPLES ms of force as one custom effect. Levels
+ * carry on along their change since the last round, so the device keeps
+ * moving smoothly until the next upload replaces the samples. Effects
+ * mixed in software are sampled at full rate.
+ *
+ * The effect loops and is updated in place. Samples are uploaded only when
+ * the lookahead runs short or the sample playing now is off from the new
+ * level, since every upload starts playback over.
+ */
+void output_stream(hapticDevice * dev, float x, float y, float z, bool shaker)
+{
+	SDL_HapticCustom *c = &dev->effect[STREAM].custom;
+	float level[AXES] = { x, y, z }, slope[AXES];
+	unsigned int now = SDL_GetTicks();
+	unsigned int dt = now - dev->stream_round;
+	unsigned int played = now - dev->stream_time;
+	int channels = c->channels;
+	int soft_axis = channels > 1 ? 1 : 0;
+	float soft = dev->software ? software_level(dev, now, shaker) : 0.0;
+	bool upload = !dev->stream_running || played + 2 * LOOP_PERIOD > STREAM_SAMPLES;
+
+	for (int a = 0; a < channels; a++) {
+		slope[a] = dt > 0 && dt < STREAM_SAMPLES ? (level[a] - dev->stream_last[a]) / dt : 0.0;
+		dev->stream_last[a] = level[a];
+
+		if (!upload) {
+			float v = clamp(level[a] + (a == soft_axis ? soft : 0.0), -32760.0, 32760.0);
+
+			if (fabs(v - (Sint16)dev->stream_data[played * channels + a]) > STREAM_TOL)
+				upload = true;
+		}
+	}
+	dev->stream_round = now;
+	if (!upload)
+		return;
+
+	for (int i = 0; i < STREAM_SAMPLES; i++) {
+		if (dev->software)
+			soft = software_level(dev, now + i, shaker);
+
+		for (int a = 0; a < channels; a++) {
+			float v = level[a] + slope[a] * i + (a == soft_axis ? soft : 0.0);
+
+			dev->stream_data[i * channels + a] = (Sint16)clamp(v, -32760.0, 32760.0);
+		}
+	}
+	dev->stream_time = now;
+	c->data = dev->stream_data;	// The device array moves as devices are added
+	reload_effect(dev, &dev->effect[STREAM], &dev->effectId[STREAM], false);
+	if (!dev->stream_running && dev->device && dev->open)
+		dev->stream_running = SDL_HapticRunEffect(dev->device, dev->effectId[STREAM], SDL_HAPTIC_INFINITY) == 0;
+}
+
+/*
+ * Hands force levels of the update loop to the output thread, or sends them
+ * right away without one.
+ */
+void send_forces(hapticDevice * dev, float x, float y, float z, bool shaker)
+{
+	forceFrame f = { x, y, z, shaker, true };
+
+	if (output.thread && !dev->remote)
+		write_frame(dev, &f);
+	else
+		output_forces(dev, x, y, z, shaker);
+}
+
+/*
+ * Sends force levels to a device. Levels are in SDL units, -32760 - 32760.
+ * The shaker is started and stopped when its trigger changes.
+ */
+void output_forces(hapticDevice * dev, float x, float y, float z, bool shaker)
+{
+	bool update = true;
+
+	if (dev->remote) {
+		remote_send_forces(dev, x, y, z, shaker);
+		return;
+	}
+
+	if (dev->effectId[STREAM] != -1)
+		output_stream(dev, x, y, z, shaker);
+
+	// Effects without a slot of their own ride on Y, or X on single axis devices
+	else if (dev->software) {
+		if (dev->combined || dev->effectId[CONST_Y] != -1)
+			y += software_level(dev, SDL_GetTicks(), shaker);
+		else
+			x += software_level(dev, SDL_GetTicks(), shaker);
+	}
+
+	// Devices slower than the loop get constant forces at the rate they sustain
+	if (dev->bench.rate > 0.0 && dev->effectId[STREAM] == -1) {
+		unsigned int now = SDL_GetTicks();
+		int calls = (dev->combined ? 1 : (dev->effectId[CONST_X] != -1) + (dev->effectId[CONST_Y] != -1))
+		    + (dev->effectId[CONST_Z] != -1);	// Z has its own effect either way
+
+		update = now - dev->update_time >= calls * 1000.0 / dev->bench.rate;
+		if (update)
+			dev->update_time = now;
+	}
+
+	if (!update) {
+		// Skipped, the next round carries the latest levels
+	} else if ((dev->supported & SDL_HAPTIC_CONSTANT) && dev->combined && dev->effectId[CONST_X] != -1) {
+		// One update points the effect along the sum of X and Y
+		SDL_HapticConstant *c = &dev->effect[CONST_X].constant;
+
+		x = clamp(x, -32760.0, 32760.0);
+		y = clamp(y, -32760.0, 32760.0);
+		if (x != 0.0 || y != 0.0) {
+			c->direction.dir[0] = x;
+			c->direction.dir[1] = -y;
+		}
+		c->level = clamp(sqrt(x * x + y * y), 0.0, 32760.0);
+		if (!reload_effect(dev, &dev->effect[CONST_X], &dev->effectId[CONST_X], true)) {
+			log_msg(LOG_WARN, "Device %d refuses combined constant force, using one per axis", dev->num);
+			dev->per_axis = true;
+			SDL_AtomicSet(&dev->recreate, 1);
+			return;
+		}
+	} else if (dev->supported & SDL_HAPTIC_CONSTANT) {
+		if (dev->axes > 0 && dev->effectId[CONST_X] != -1) {
+			dev->effect[CONST_X].constant.level = (signed short)clamp(x, -32760.0, 32760.0);
+			reload_effect(dev, &dev->effect[CONST_X], &dev->effectId[CONST_X], true);
+		}
+		if (dev->axes > 1 && dev->effectId[CONST_Y] != -1) {
+			dev->effect[CONST_Y].constant.level = (signed short)clamp(y, -32760.0, 32760.0);
+			reload_effect(dev, &dev->effect[CONST_Y], &dev->effectId[CONST_Y], true);
+		}
+	}
+	// Z has an effect of its own either way
+	if (update && (dev->supported & SDL_HAPTIC_CONSTANT) && dev->axes > 2 && dev->effectId[CONST_Z] != -1) {
+		dev->effect[CONST_Z].constant.level = (signed short)clamp(z, -32760.0, 32760.0);
+		reload_effect(dev, &dev->effect[CONST_Z], &dev->effectId[CONST_Z], true);
+	}
+	// Stick shaker trigger
+	if (dev->effectId[STICK_SHAKER] != -1) {
+		if (shaker && !dev->shaker_on)
+			reload_effect(dev, &dev->effect[STICK_SHAKER], &dev->effectId[STICK_SHAKER], true);
+		else if (!shaker && dev->shaker_on)
+			SDL_HapticStopEffect(dev->device, dev->effectId[STICK_SHAKER]);
+	}
+	dev->shaker_on = shaker;
+}
+
+/*
+ * Waveform used for a periodic effect, or 0 if the device has none that fits.
+ */
+unsigned int periodic_type(hapticDevice * dev, int effect)
+{
+	if (effect == GROUND_RUMBLE && (dev->supported & SDL_HAPTIC_TRIANGLE))
+		return SDL_HAPTIC_TRIANGLE;
+	if (effect == ENGINE_VIBRATION && (dev->supported & SDL_HAPTIC_SAWTOOTHUP))
+		return SDL_HAPTIC_SAWTOOTHUP;
+	if (dev->supported & SDL_HAPTIC_SINE)
+		return SDL_HAPTIC_SINE;
+	return 0;
+}
+
+/*
+ * True if a periodic effect is played by the device. Effects of remote
+ * devices are created by the force server.
+ */
+bool has_periodic(hapticDevice * dev, int effect)
+{
+	if (dev->remote)
+		return periodic_type(dev, effect) != 0 || (dev->supported & SDL_HAPTIC_CONSTANT);
+	return dev->effectId[effect] != -1 || (dev->software & (1 << effect));
+}
+
+/*
+ * Updates period (ms) and magnitude of a periodic effect, period 0 stops it.
+ * The device is touched only when they change meaningfully, waveform
+ * generation is left to the device unless the effect is mixed in software.
+ */
+void output_periodic(hapticDevice * dev, int effect, float period, float magnitude)
+{
+	SDL_HapticPeriodic *p = &dev->effect[effect].periodic;
+	bool running = dev->periodic_on & (1 << effect);
+	Uint16 new_period = clamp(period, 1.0, 65535.0);
+	Sint16 new_magnitude = clamp(magnitude, 0.0, 32760.0);
+
+	if (period < 1.0 || new_magnitude == 0) {
+		if (!running)
+			return;
+		dev->periodic_on &= ~(1 << effect);
+		if (dev->remote)
+			remote_send_periodic(dev, effect, 0, 0);
+		else if (dev->effectId[effect] != -1)
+			SDL_HapticStopEffect(dev->device, dev->effectId[effect]);
+		return;
+	}
+
+	if (running && abs(new_period - p->period) < PERIODIC_PERIOD_TOL * p->period
+	    && abs(new_magnitude - p->magnitude) < PERIODIC_LEVEL_TOL)
+		return;
+
+	p->period = new_period;
+	p->magnitude = new_magnitude;
+	dev->periodic_on |= 1 << effect;
+
+	if (dev->remote)
+		remote_send_periodic(dev, effect, new_period, new_magnitude);
+	else if (dev->effectId[effect] != -1)
+		reload_effect(dev, &dev->effect[effect], &dev->effectId[effect], !running);
+}
+
+/*
+ * Condition effect played in a slot, 0 if the slot is not a condition.
+ */
+unsigned int condition_type(int effect)
+{
+	switch (effect) {
+	case SPRING:
+		return SDL_HAPTIC_SPRING;
+	case DAMPER:
+		return SDL_HAPTIC_DAMPER;
+	case FRICTION:
+		return SDL_HAPTIC_FRICTION;
+	}
+	return 0;
+}
+
+bool has_condition(hapticDevice * dev, int effect)
+{
+	if (dev->remote)
+		return (dev->supported & condition_type(effect)) && dev->axes >= 1;
+	return dev->effectId[effect] != -1;
+}
+
+/*
+ * Sets the coefficient of a condition effect on all axes, 0 - 32767.
+ * The effect keeps running on the device, it is updated only when the
+ * coefficient changes meaningfully.
+ */
+void output_condition(hapticDevice * dev, int effect, float coeff)
+{
+	SDL_HapticCondition *c = &dev->effect[effect].condition;
+	Sint16 new_coeff = clamp(coeff, 0.0, 32767.0);
+
+	if (dev->remote) {
+		if (abs(new_coeff - dev->condition_coeff[effect]) < CONDITION_TOL
+		    && (new_coeff != 0 || dev->condition_coeff[effect] == 0))
+			return;
+		dev->condition_coeff[effect] = new_coeff;
+		remote_send_condition(dev, effect, new_coeff);
+		return;
+	}
+
+	if (abs(new_coeff - c->right_coeff[0]) < CONDITION_TOL && (new_coeff != 0 || c->right_coeff[0] == 0))
+		return;
+
+	for (int a = 0; a < dev->axes && a < AXES; a++) {
+		c->right_coeff[a] = new_coeff;
+		c->left_coeff[a] = new_coeff;
+	}
+	reload_effect(dev, &dev->effect[effect], &dev->effectId[effect], false);
+}
+
+/*
+ * Appends a chunk of the given wire type, fed from property node, to the
+ * generic protocol.
+ */
+void add_field(const char *node, const char *type)
+{
+	protocolField *f;
+	char path[MAXMSG];
+	int len = 0;
+
+	if (protocol.num_fields >= MAX_FIELDS)
+		return;
+	f = &protocol.field[protocol.num_fields++];
+
+	f->size = 4;
+	if (strcmp(type, "float") == 0) {
+		f->type = FIELD_FLOAT;
+	} else if (strcmp(type, "double") == 0) {
+		f->type = FIELD_DOUBLE;
+		f->size = 8;
+	} else if (strcmp(type, "bool") == 0) {
+		f->type = FIELD_BOOL;
+		f->size = 1;
+	} else if (strcmp(type, "fixed") == 0) {
+		f->type = FIELD_FIXED;
+	} else {
+		f->type = FIELD_INT;
+	}
+	protocol.length += f->size;
+
+	// Ignore doubled slashes, flightgear does too
+	for (; *node && len < MAXMSG - 1; node++)
+		if (*node != '/' || len == 0 || path[len - 1] != '/')
+			path[len++] = *node;
+	path[len] = '\0';
+
+	f->offset = -1;
+	for (int k = 0; k < PROTOCOL_NODES; k++) {
+		if (strcmp(path, protocol_nodes[k].node) == 0) {
+			f->offset = protocol_nodes[k].offset;
+			f->target = protocol_nodes[k].target;
+		}
+	}
+	if (f->offset < 0)
+		printf("   %s is not used by fg-haptic\n", path);
+	else if (f->offset == offsetof(effectParams, aoa))
+		protocol.native = true;
+	else if (f->offset == offsetof(effectParams, sim_time))
+		protocol.timed = true;
+}
+
+/*
+ * Copies the contents of the first <tag> between p and end into value.
+ * Returns a pointer past the closing tag, or NULL if there is none.
+ */
+const char *xml_value(const char *p, const char *end, const char *tag, char *value, size_t len)
+{
+	char open[NAMELEN + 3], close[NAMELEN + 4];
+	const char *a, *b;
+
+	snprintf(open, sizeof(open), "<%s>", tag);
+	snprintf(close, sizeof(close), "</%s>", tag);
+	a = strstr(p, open);
+	if (!a || a >= end)
+		return NULL;
+	a += strlen(open);
+	b = strstr(a, close);
+	if (!b || b > end)
+		return NULL;
+
+	// Trim white space
+	while (a < b && isspace((unsigned char)*a))
+		a++;
+	while (b > a && isspace((unsigned char)b[-1]))
+		b--;
+	if (value) {
+		if ((size_t) (b - a) >= len)
+			b = a + len - 1;
+		memcpy(value, a, b - a);
+		value[b - a] = '\0';
+	}
+	return strstr(b, close) + strlen(close);
+}
+
+/*
+ * Builds the generic IO decoder from the output section of a flightgear
+ * protocol file. Falls back to the layout of the ff-protocol.xml shipped
+ * with fg-haptic if the file can't be read.
+ */
+void load_protocol(const char *file)
+{
+	char value[MAXMSG], node[MAXMSG], type[NAMELEN + 1];
+	char *xml = NULL, *a, *b;
+	const char *p, *end, *chunk_end;
+	FILE *f;
+	long size = 0;
+
+	memset(&protocol, 0, sizeof(genericProtocol));
+	protocol.separator = '|';
+
+	f = fopen(file, "rb");
+	if (f) {
+		fseek(f, 0, SEEK_END);
+		size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		xml = malloc(size + 1);
+		if (xml && fread(xml, 1, size, f) == (size_t) size)
+			xml[size] = '\0';
+		else
+			size = 0;
+		fclose(f);
+	}
+
+	p = xml ? strstr(xml, "<output>") : NULL;
+	end = p ? strstr(p, "</output>") : NULL;
+	if (size == 0 || !p || !end) {
+		printf("Unable to read %s, using built-in generic protocol\n", file);
+		for (int k = 0; k < PROTOCOL_NODES; k++)
+			add_field(protocol_nodes[k].node, protocol_nodes[k].target == FIELD_DOUBLE ? "double" :
+				  protocol_nodes[k].target == FIELD_FLOAT ? "float" : "int");
+		free(xml);
+		return;
+	}
+
+	// Blank out comments, they may contain anything
+	for (a = strstr(xml, "<!--"); a; a = strstr(a, "<!--")) {
+		b = strstr(a, "-->");
+		b = b ? b + 3 : xml + size;
+		memset(a, ' ', b - a);
+	}
+
+	printf("Reading generic protocol from %s\n", file);
+
+	if (xml_value(p, end, "binary_mode", value, sizeof(value)))
+		protocol.binary = strcmp(value, "true") == 0;
+	if (xml_value(p, end, "byte_order", value, sizeof(value)))
+		protocol.network_order = strcmp(value, "network") == 0;
+	if (xml_value(p, end, "binary_footer", value, sizeof(value)) && strcmp(value, "none") != 0)
+		protocol.length += 4;	// Length or magic number, not checked
+	if (xml_value(p, end, "var_separator", value, sizeof(value))) {
+		if (strcmp(value, "tab") == 0)
+			protocol.separator = '\t';
+		else if (strcmp(value, "space") == 0)
+			protocol.separator = ' ';
+		else if (strcmp(value, "newline") == 0)
+			protocol.separator = '\n';
+		else if (value[0])
+			protocol.separator = value[0];
+	}
+
+	while ((a = strstr(p, "<chunk>")) && a < end) {
+		chunk_end = strstr(a, "</chunk>");
+		if (!chunk_end || chunk_end > end)
+			break;
+		if (!xml_value(a, chunk_end, "type", type, sizeof(type)))
+			strcpy(type, "int");	// Flightgear default
+		if (xml_value(a, chunk_end, "node", node, sizeof(node)))
+			add_field(node, type);
+		p = chunk_end + strlen("</chunk>");
+	}
+	free(xml);
+
+	printf("   %d chunks, %s mode\n", protocol.num_fields, protocol.binary ? "binary" : "text");
+}
+
+void store_field(protocolField * f, effectParams * params, double v)
+{
+	if (f->offset < 0)
+		return;
+	if (f->target == FIELD_DOUBLE)
+		*(double *)((char *)params + f->offset) = v;
+	else if (f->target == FIELD_FLOAT)
+		*(float *)((char *)params + f->offset) = v;
+	else
+		*(int *)((char *)params + f->offset) = v;
+}
+
+/*
+ * Decodes a text mode line into params. Returns the number of fields
+ * found, or -1 if the line is malformed.
+ */
+int decode_text(const char *p, effectParams * params)
+{
+	char *end;
+	double v;
+	int n;
+
+	for (n = 0; n < protocol.num_fields && *p; n++) {
+		v = strtod(p, &end);
+		if (end == p)
+			return -1;
+		store_field(&protocol.field[n], params, v);
+
+		p = end;
+		if (*p == protocol.separator)
+			p++;
+		else if (*p != '\0')
+			return -1;
+	}
+	return n;
+}
+
+/*
+ * Decodes a binary record of protocol.length bytes into params.
+ */
+void decode_binary(const Uint8 * p, effectParams * params)
+{
+	for (int n = 0; n < protocol.num_fields; n++) {
+		protocolField *f = &protocol.field[n];
+		union {
+			Uint32 i;
+			float f;
+		} u32;
+		union {
+			Uint64 i;
+			double d;
+		} u64;
+		double v;
+
+		if (f->size == 1) {
+			v = *p;
+		} else if (f->size == 4) {
+			if (protocol.network_order)
+				u32.i = SDLNet_Read32(p);
+			else
+				memcpy(&u32.i, p, 4);
+			if (f->type == FIELD_FLOAT)
+				v = u32.f;
+			else if (f->type == FIELD_FIXED)
+				v = (Sint32) u32.i / 65536.0;
+			else
+				v = (Sint32) u32.i;
+		} else {
+			if (protocol.network_order)
+				u64.i = (Uint64) SDLNet_Read32(p) << 32 | SDLNet_Read32(p + 4);
+			else
+				memcpy(&u64.i, p, 8);
+			v = u64.d;
+		}
+		store_field(f, params, v);
+		p += f->size;
+	}
+}
+
+/*
+ * Stick shaker and pusher from raw AoA, with hysteresis so they don't
+ * chatter around their thresholds. Runs on every sample as it arrives.
+ */
+void run_native_logic(fgInstance * fg, effectParams * p)
+{
+	if (p->aoa > p->shaker_aoa)
+		fg->shaker = true;
+	else if (p->aoa < p->shaker_aoa - AOA_HYSTERESIS)
+		fg->shaker = false;
+	p->shaker_trigger |= fg->shaker;	// Nasal may still trigger it, in test mode
+
+	// The pusher ramps in over its working angle, pushing the elevator forward
+	if (p->aoa > p->pusher_aoa)
+		fg->pusher = true;
+	else if (p->aoa < p->pusher_aoa - AOA_HYSTERESIS)
+		fg->pusher = false;
+	if (fg->pusher && p->pusher_angle > 0.001)
+		p->stick[1] += clamp((p->aoa - p->pusher_aoa) / p->pusher_angle, 0.0, 1.0);
+}
+
+/*
+ * Spring centre of device axis a for force trim, -1 - 1. A restoring spring
+ * moved by c pushes with c times its stiffness at the old centre, so this
+ * is the trim force the axis gets through the mix, per unit of stiffness.
+ */
+float trim_center(hapticDevice * dev, const float *trim, int a)
+{
+	int k = dev->stick_axes[a];
+
+	if (k < 0 || k >= AXES)
+		return 0.0;
+	return clamp(trim_sign[k] * trim[k] * (dev->invert[a] ? -1.0 : 1.0), -1.0, 1.0);
+}
+
+/*
+ * Moves the spring centre of a device to the force trim position. Returns
+ * false if the device has no spring of its own to move.
+ */
+bool output_trim(hapticDevice * dev, const float *trim)
+{
+	SDL_HapticCondition *c = &dev->effect[SPRING].condition;
+	bool changed = false;
+
+	if (dev->remote || dev->effectId[SPRING] == -1)
+		return false;
+
+	for (int a = 0; a < dev->axes && a < AXES; a++) {
+		dev->trim_center[a] = trim_center(dev, trim, a) * 32767.0;
+		if (abs(dev->trim_center[a] - c->center[a]) >= CONDITION_TOL
+		    || (dev->trim_center[a] == 0 && c->center[a] != 0)) {
+			c->center[a] = dev->trim_center[a];
+			changed = true;
+		}
+	}
+	if (changed)
+		reload_effect(dev, &dev->effect[SPRING], &dev->effectId[SPRING], false);
+	return true;
+}
+
+/*
+ * Fills out with white noise, -1 - 1, from one xorshift generator per
+ * lane. Lanes don't depend on each other, so the loop vectorizes.
+ */
+void synth_noise(Uint32 * state, float *out, int n)
+{
+	for (int k = 0; k < n; k++) {
+		Uint32 s = state[k];
+
+		s ^= s << 13;
+		s ^= s >> 17;
+		s ^= s << 5;
+		state[k] = s;
+		out[k] = (Sint32)s * (1.0 / 2147483648.0);
+	}
+}
+
+/*
+ * Buffet and turbulence of each control axis for this update, -1 - 1.
+ * Buffet grows as AoA nears stall, turbulence follows the envelope kept by
+ * read_fg(). Noise is band limited by the difference of two low pass filters.
+ */
+void synth_forces(hapticDevice * dev, const effectParams * p, float turbulence, unsigned int dt, float *out)
+{
+	float noise[2 * AXES];
+	float buffet = 0.0;
+
+	if (p->stall_aoa > 0.001) {
+		buffet = clamp((p->aoa - p->stall_aoa + BUFFET_ONSET) / BUFFET_ONSET, 0.0, 1.0);
+		buffet *= buffet;
+	}
+	buffet *= BUFFET_SCALE * dev->buffet_gain;
+	turbulence *= TURBULENCE_SCALE * dev->turbulence_gain;
+
+	synth_noise(dev->noise, noise, 2 * AXES);
+	for (int k = 0; k < AXES; k++) {
+		dev->band_fast[k] += (noise[k] - dev->band_fast[k]) * dt / (BUFFET_FAST + dt);
+		dev->band_slow[k] += (dev->band_fast[k] - dev->band_slow[k]) * dt / (BUFFET_SLOW + dt);
+		out[k] = (dev->band_fast[k] - dev->band_slow[k]) * buffet * buffet_axes[k];
+	}
+	for (int k = 0; k < AXES; k++) {
+		int t = AXES + k;
+
+		dev->band_fast[t] += (noise[t] - dev->band_fast[t]) * dt / (TURBULENCE_FAST + dt);
+		dev->band_slow[t] += (dev->band_fast[t] - dev->band_slow[t]) * dt / (TURBULENCE_SLOW + dt);
+		out[k] = clamp(out[k] + (dev->band_fast[t] - dev->band_slow[t]) * turbulence * turbulence_axes[k],
+			       -1.0, 1.0);
+	}
+}
+
+/*
+ * Spring and damper of each device axis from the stick position, in SDL
+ * force units. Stiffness follows control loading and the spring centres
+ * on the force trim, as the device spring would.
+ */
+void closed_loop_forces(hapticDevice * dev, const effectParams * p, unsigned int dt, float *out)
+{
+	float loading = clamp(p->control_loading, 0.0, 1.0);
+	int axes = SDL_JoystickNumAxes(dev->joystick);
+
+	for (int a = 0; a < dev->axes && a < AXES; a++) {
+		float pos, center = trim_center(dev, p->trim, a);
+
+		out[a] = 0.0;
+		if (a >= axes)
+			continue;
+
+		pos = SDL_JoystickGetAxis(dev->joystick, a) / 32767.0;
+		if (dt > 0) {
+			float rate = (pos - dev->position[a]) * 1000.0 / dt;
+
+			dev->velocity[a] += (rate - dev->velocity[a]) * dt / (LOOP_VELOCITY_TAU + dt);
+		}
+		dev->position[a] = pos;
+
+		out[a] = -loading * (dev->spring_gain * (pos - center)
+				     + dev->damper_gain * LOOP_DAMPER_TIME * dev->velocity[a]) * 32760.0;
+		if (dev->loop_reverse)
+			out[a] = -out[a];
+	}
+}
+
+/*
+ * Turbulence envelope from vertical acceleration changes between samples.
+ * It jumps up with each bump and fades out between them.
+ */
+void update_turbulence(fgInstance * fg, const effectParams * p, unsigned int now)
+{
+	if (fg->accel_valid) {
+		float bump = fabs(p->accel_z - fg->accel_z) / (G_FPS * TURBULENCE_FULL);
+
+		fg->turbulence *= exp(-(float)(now - fg->accel_time) / TURBULENCE_DECAY);
+		if (bump > fg->turbulence)
+			fg->turbulence = clamp(bump, 0.0, 1.0);
+	}
+	fg->accel_z = p->accel_z;
+	fg->accel_time = now;
+	fg->accel_valid = true;
+}
+
+/*
+ * Feeds a sample of stick and pilot forces to the predictor of an instance.
+ */
+void update_predictor(forcePredictor * p, const effectParams * params, unsigned int now)
+{
+	float z[FILTERED_SOURCES];
+	int dt_ms = now - p->time;
+	float dt = dt_ms / 1000.0;
+
+	memcpy(&z[0], params->stick, sizeof(params->stick));
+	memcpy(&z[AXES], params->pilot, sizeof(params->pilot));
+
+	if (!p->valid || dt_ms > PREDICT_RESET) {
+		memcpy(p->x, z, sizeof(z));
+		memset(p->v, 0, sizeof(p->v));
+	} else if (dt_ms <= 0) {
+		return;		// Forces computed at the same time or before the last ones
+	} else {
+		for (int k = 0; k < FILTERED_SOURCES; k++) {
+			float r = z[k] - (p->x[k] + p->v[k] * dt);
+
+			p->x[k] += p->v[k] * dt + PREDICT_ALPHA * r;
+			p->v[k] += PREDICT_BETA * r / dt;
 		}
 	}
+	p->time = now;
+	p->valid = true;
+}
 
-	fgfswrite(telnet_sock, "set /haptic/reconfigure 0");
-	printf("Waiting for the command to go through...\n");
-	do {
-		fgfswrite(telnet_sock, "get /haptic/reconfigure");
-		p = fgfsread(telnet_sock, READ_TIMEOUT);
-		if (p)
-			read = sscanf(p, "%d", &idata);
-		else
-			read = 0;
-	} while (read == 1 && idata == 1);
-	printf("Done\n");
+/*
+ * Replaces stick and pilot forces in src with those expected when the
+ * device applies them: after the age of the sample, the remote link and
+ * the latency of flightgear and USB given by --predict.
+ */
+void predict_forces(fgInstance * fg, hapticDevice * dev, unsigned int now, float *src)
+{
+	forcePredictor *p = &fg->predict;
+	float lead = predict_ms + (now - p->time);
 
-	fgfsflush(client_sock);	// Get rid of FF data that was received during reinitialization
+	if (!p->valid)
+		return;
+	if (dev->remote)
+		lead += remote.rtt_avg / 2.0;
+	lead = clamp(lead, 0.0, PREDICT_MAX) / 1000.0;
 
-	return;
+	for (int k = 0; k < FILTERED_SOURCES; k++)
+		src[k] = p->x[k] + p->v[k] * lead;
 }
 
-void create_effects(void)
+/*
+ * Ages a timestamped sample and keeps the statistics. Returns false if the
+ * sample is out of order or too old to use. time is set to when the forces
+ * were computed, on the local clock.
+ */
+bool check_timing(fgInstance * fg, const effectParams * p, unsigned int now, unsigned int *time)
 {
-	for (int i = 0; i < num_devices; i++) {
-		// Delete existing effects
-		for (int x = 0; x < SDL_HapticNumEffects(devices[i].device); x++) {
-			SDL_HapticDestroyEffect(devices[i].device, x);
-			if (x < sizeof(devices[i].effectId) / sizeof(devices[i].effectId[0])) {
-				devices[i].effectId[x] = -1;
-			}
-		}
+	sampleTiming *t = &fg->timing;
+	double sim = p->sim_time * 1000.0;
+	float speed_up = p->speed_up > 0.0 ? p->speed_up : 1.0;
+	double offset;
+	float age;
+
+	// Restart when the simulator is reset
+	if (!t->valid || p->sim_time < t->last_time - 1.0) {
+		t->valid = true;
+		t->window_end = now + TIMING_WINDOW;
+		t->last_time = p->sim_time;
+		t->last_seq = p->sequence;
+	}
 
-		memset(&devices[i].effect[0], 0, sizeof(SDL_HapticEffect) * EFFECTS);
+	if (p->sim_time != t->still_time) {
+		t->still_time = p->sim_time;
+		t->still_since = now;
+	}
 
-		printf("Creating effects for device %d\n", i + 1);
+	// Paused or changing rate, simulator time no longer follows the clock.
+	// Samples sent meanwhile are current, and the next running ones are
+	// aged from the last of them.
+	if (p->freeze || (Sint32)(now - t->still_since) >= PAUSE_STILL || speed_up != t->speed_up) {
+		t->anchor_sim = sim;
+		t->anchor_now = now;
+		t->speed_up = speed_up;
+		t->base = t->window_min = 0.0;
+	}
+	offset = (int)(now - t->anchor_now) - (sim - t->anchor_sim) / speed_up;
+
+	if (offset < t->window_min)
+		t->window_min = offset;
+	if (offset < t->base)
+		t->base = offset;
+	if ((Sint32)(now - t->window_end) >= 0) {
+		if (t->stale || t->gaps)
+			log_msg(LOG_INFO, "Instance %d: %u samples, %.1f ms old on average, %.1f at most, %u dropped as stale, %u force updates lost",
+				fg->num, t->samples, t->samples ? t->age_sum / t->samples : 0.0, t->age_max, t->stale, t->gaps);
+		t->samples = t->stale = t->gaps = t->repeats = 0;
+		t->age_sum = t->age_max = 0.0;
+
+		t->base = t->window_min;	// Follows drift between the clocks
+		t->window_min = offset;
+		t->window_end = now + TIMING_WINDOW;
+	}
 
-		// Set autocenter and gain
-		if (devices[i].supported & SDL_HAPTIC_AUTOCENTER)
-			SDL_HapticSetAutocenter(devices[i].device, devices[i].autocenter * 100);
+	// Forces are as old as the sample, plus their wait for flightgear to send them
+	age = offset - t->base;
+	if (p->force_time > 0.0 && p->force_time <= p->sim_time)
+		age += (p->sim_time - p->force_time) * 1000.0;
+	*time = now - age;
 
-		if (devices[i].supported & SDL_HAPTIC_GAIN)
-			SDL_HapticSetGain(devices[i].device, devices[i].gain * 100);
+	if (p->sim_time < t->last_time || age > STALE_AGE) {
+		t->stale++;
+		return false;
+	}
 
-		// Stick shaker
-		if (devices[i].supported & SDL_HAPTIC_SINE && devices[i].shaker_gain > 0.001) {
-			devices[i].effect[STICK_SHAKER].type = SDL_HAPTIC_SINE;
-			devices[i].effect[STICK_SHAKER].periodic.direction.type = SDL_HAPTIC_POLAR;
-			devices[i].effect[STICK_SHAKER].periodic.direction.dir[0] = devices[i].shaker_dir;
-			devices[i].effect[STICK_SHAKER].periodic.direction.dir[1] = 0;
-			devices[i].effect[STICK_SHAKER].periodic.direction.dir[2] = 0;
-			devices[i].effect[STICK_SHAKER].periodic.length = 5000;	// Default 5 seconds?
-			devices[i].effect[STICK_SHAKER].periodic.period = devices[i].shaker_period;
-			devices[i].effect[STICK_SHAKER].periodic.magnitude = 0x4000;
-			devices[i].effect[STICK_SHAKER].periodic.attack_length = 300;	// 0.3 sec fade in
-			devices[i].effect[STICK_SHAKER].periodic.fade_length = 300;	// 0.3 sec fade out
+	if (p->sequence == t->last_seq)
+		t->repeats++;
+	else if (p->sequence > t->last_seq + 1)
+		t->gaps += p->sequence - t->last_seq - 1;
+	t->last_seq = p->sequence;
+	t->last_time = p->sim_time;
+
+	t->samples++;
+	t->age_sum += age;
+	if (age > t->age_max)
+		t->age_max = age;
+	return true;
+}
 
-			devices[i].effectId[STICK_SHAKER] = SDL_HapticNewEffect(devices[i].device, &devices[i].effect[STICK_SHAKER]);
-			if (devices[i].effectId[STICK_SHAKER] < 0) {
-				printf("UPLOADING EFFECT ERROR: %s\n", SDL_GetError());
-				devices[i].effectId[STICK_SHAKER] = -1;
-				devices[i].supported &= ~SDL_HAPTIC_SINE;
-			}
-		}
-		// X axis
-		if (devices[i].supported & SDL_HAPTIC_CONSTANT && devices[i].axes > 0) {
-			devices[i].effect[CONST_X].type = SDL_HAPTIC_CONSTANT;
-			devices[i].effect[CONST_X].constant.direction.type = SDL_HAPTIC_CARTESIAN;
-			devices[i].effect[CONST_X].constant.direction.dir[0] = 0x1000;
-			devices[i].effect[CONST_X].constant.direction.dir[1] = 0;
-			devices[i].effect[CONST_X].constant.direction.dir[2] = 0;
-			devices[i].effect[CONST_X].constant.length = 60000;	// By default constant fore is always applied
-			devices[i].effect[CONST_X].constant.level = 0x1000;
-
-			devices[i].effectId[CONST_X] = SDL_HapticNewEffect(devices[i].device, &devices[i].effect[CONST_X]);
-			if (devices[i].effectId[CONST_X] < 0) {
-				printf("UPLOADING CONST_X EFFECT ERROR: %s\n", SDL_GetError());
-				devices[i].effectId[CONST_X] = -1;
-				devices[i].supported &= ~SDL_HAPTIC_CONSTANT;
-			}
-		}
-		// Y axis
-		if (devices[i].supported & SDL_HAPTIC_CONSTANT && devices[i].axes > 1) {
-			devices[i].effect[CONST_Y].type = SDL_HAPTIC_CONSTANT;
-			devices[i].effect[CONST_Y].constant.direction.type = SDL_HAPTIC_CARTESIAN;
-			devices[i].effect[CONST_Y].constant.direction.dir[0] = 0;
-			devices[i].effect[CONST_Y].constant.direction.dir[1] = -0x1000;
-			devices[i].effect[CONST_Y].constant.direction.dir[2] = 0;
-			devices[i].effect[CONST_Y].constant.length = 60000;	// By default constant fore is always applied
-			devices[i].effect[CONST_Y].constant.level = 0x1000;
-
-			devices[i].effectId[CONST_Y] = SDL_HapticNewEffect(devices[i].device, &devices[i].effect[CONST_Y]);
-			if (devices[i].effectId[CONST_Y] < 0) {
-				printf("UPLOADING CONST_Y EFFECT ERROR: %s\n", SDL_GetError());
-				devices[i].effectId[CONST_Y] = -1;
-				devices[i].supported &= ~SDL_HAPTIC_CONSTANT;
+void read_fg(fgInstance * fg)
+{
+	effectParams params;
+	const char *p;
+	int read;
+	unsigned int now, time;
+
+	for (int tries = 0;; tries++) {
+		// Don't block other instances
+		if (protocol.binary)
+			p = fgfsreadrecord(&fg->generic, protocol.length, 0);
+		else
+			p = fgfsread(&fg->generic, 0);
+		if (!p)
+			return;		// Null pointer, read failed
+
+		memset(&params, 0, sizeof(effectParams));
+		if (protocol.binary) {
+			decode_binary((const Uint8 *)p, &params);
+		} else {
+			read = decode_text(p, &params);
+			if (read < 0) {
+				log_msg(LOG_ERROR, "Error reading generic I/O of instance %d", fg->num);
+				return;
 			}
-		}
-		// Z axis
-		if (devices[i].supported & SDL_HAPTIC_CONSTANT && devices[i].axes > 2) {
-			devices[i].effect[CONST_Z].type = SDL_HAPTIC_CONSTANT;
-			devices[i].effect[CONST_Z].constant.direction.type = SDL_HAPTIC_CARTESIAN;
-			devices[i].effect[CONST_Z].constant.direction.dir[0] = 0;
-			devices[i].effect[CONST_Z].constant.direction.dir[1] = 0;
-			devices[i].effect[CONST_Z].constant.direction.dir[2] = 0x1000;
-			devices[i].effect[CONST_Z].constant.length = 60000;	// By default constant fore is always applied
-			devices[i].effect[CONST_Z].constant.level = 0x1000;
-
-			devices[i].effectId[CONST_Z] = SDL_HapticNewEffect(devices[i].device, &devices[i].effect[CONST_Z]);
-			if (devices[i].effectId[CONST_Z] < 0) {
-				printf("UPLOADING CONST_Y EFFECT ERROR: %s\n", SDL_GetError());
-				devices[i].effectId[CONST_Z] = -1;
-				devices[i].supported &= ~SDL_HAPTIC_CONSTANT;
+			// Chunks missing from the end are left at zero
+			if (read != protocol.num_fields && !fg->warned) {
+				log_msg(LOG_WARN, "Generic IO of instance %d has %d chunks, expected %d. Check ff-protocol.xml",
+					fg->num, read, protocol.num_fields);
+				fg->warned = true;
 			}
 		}
 
+		// Stale samples are skipped, to catch up with a backlog
+		now = time = SDL_GetTicks();
+		if (!protocol.timed || check_timing(fg, &params, now, &time))
+			break;
+
+		// Still behind, the last good sample stays until the next round
+		if (tries >= STALE_CATCHUP)
+			return;
 	}
+
+	if (native_logic)
+		run_native_logic(fg, &params);
+	update_turbulence(fg, &params, now);
+	if (predict_ms > 0.0)
+		update_predictor(&fg->predict, &params, time);
+	if (memcmp(&params, &fg->new_params, offsetof(effectParams, sim_time)) != 0)
+		fg->changed = now;
+	fg->new_params = params;
+
+	if (params.reconfigure & 1)
+		fg->reconf_request = true;
 }
 
-void reload_effect(hapticDevice * device, SDL_HapticEffect * effect, int *effectId, bool run)
+/*
+ * Keeps the constant forces of fg's devices playing while no updates are
+ * sent. Streamed forces loop their last round.
+ */
+void hold_forces(fgInstance * fg)
 {
-	if (!device->device || !device->open)
-		return;
+	forceFrame hold = { 0.0, 0.0, 0.0, false, false };
 
-	if (SDL_HapticUpdateEffect(device->device, *effectId, effect) < 0)
-		printf("Update error: %s\n", SDL_GetError());
-	if (run)
-		if (SDL_HapticRunEffect(device->device, *effectId, 1) < 0)
-			printf("Run error: %s\n", SDL_GetError());
+	output_lock();
+	for (int i = 0; i < num_devices; i++) {
+		hapticDevice *dev = &devices[i];
+
+		if (dev->fg != fg || dev->remote || !dev->device || !dev->open)
+			continue;
+		write_frame(dev, &hold);
+		if (dev->effectId[STREAM] != -1)
+			SDL_HapticRunEffect(dev->device, dev->effectId[STREAM], SDL_HAPTIC_INFINITY);
+		for (int x = CONST_X; x <= CONST_Z; x++)
+			if (dev->effectId[x] != -1)
+				SDL_HapticRunEffect(dev->device, dev->effectId[x], 1);
+	}
+	output_unlock();
+}
+
+/*
+ * Instance fg goes idle when its samples have not changed for a while and
+ * nothing it drives needs updates of its own: turbulence dying out,
+ * vibration, effects mixed in software or the closed loop. Local devices of
+ * an idle instance hold their last force, remote ones keep getting it so the
+ * force server doesn't let go. The first changed sample ends idle mode.
+ */
+void update_idle(fgInstance * fg, unsigned int now)
+{
+	bool idle = fg->state == FG_RUNNING && !fg->busy && fg->turbulence < 0.001
+	    && (int)(now - fg->changed) >= (fg->new_params.freeze ? IDLE_FROZEN : IDLE_AFTER);
+
+	if (idle && !fg->idle) {
+		log_msg(LOG_INFO, "Instance %d is %s, holding forces", fg->num, fg->new_params.freeze ? "paused" : "idle");
+		hold_forces(fg);
+		fg->held = now;
+	} else if (idle && now - fg->held >= IDLE_REFRESH) {
+		hold_forces(fg);
+		fg->held = now;
+	} else if (!idle && fg->idle) {
+		log_msg(LOG_INFO, "Instance %d is active", fg->num);
+	}
+	fg->idle = idle;
+	fg->busy = false;	// Set again by the devices of this round
 }
 
-void read_fg(void)
+/*
+ * Makes every instance send forces again, after devices or settings change.
+ */
+void wake_instances(void)
 {
-	int reconf, read;
-	const char *p;
+	for (int n = 0; n < num_instances; n++)
+		instances[n].changed = SDL_GetTicks();
+}
 
-	p = fgfsread(client_sock, TIMEOUT);
-	if (!p)
-		return;		// Null pointer, read failed
+/*
+ * Loop wait while every instance is idle or not running. Returns as soon as
+ * a running instance sends something, or after IDLE_PERIOD.
+ */
+void idle_wait(void)
+{
+	static SDLNet_SocketSet set = NULL;
+	int socks = 0;
 
-	memset(&new_params, 0, sizeof(effectParams));
+	if (!set && !(set = SDLNet_AllocSocketSet(MAX_INSTANCES))) {
+		SDL_Delay(IDLE_PERIOD);
+		return;
+	}
 
-	// Divide the buffer into chunks
-	read = sscanf(p, "%d|%f|%f|%f|%f|%f|%f|%d|%f", &reconf,
-		      &new_params.pilot[0], &new_params.pilot[1], &new_params.pilot[2],
-		      &new_params.stick[0], &new_params.stick[1], &new_params.stick[2],
-		      &new_params.shaker_trigger, &new_params.rumble_period);
+	for (int n = 0; n < num_instances; n++) {
+		fgConn *c = &instances[n].generic;
 
-	if (read != 9) {
-		printf("Error reading generic I/O!\n");
-		return;
+		if (instances[n].state != FG_RUNNING || !c->sock)
+			continue;
+		if (c->inlen > 0) {
+			socks = -1;	// Already received, read it after the usual period
+			break;
+		}
+		SDLNet_TCP_AddSocket(set, c->sock);
+		socks++;
 	}
-	// printf("%s, %d\n", p, reconf);
 
-	// Do it the easy way...
-	// memcpy(&devices[0].params, &new_params, sizeof(effectParams));
+	if (socks > 0)
+		SDLNet_CheckSockets(set, IDLE_PERIOD);
+	else
+		SDL_Delay(socks < 0 ? LOOP_PERIOD : IDLE_PERIOD);
 
-	if (reconf & 1)
-		reconf_request = true;
+	for (int n = 0; n < num_instances; n++)
+		if (instances[n].generic.sock)
+			SDLNet_TCP_DelSocket(set, instances[n].generic.sock);
+	if (!output.thread)
+		rt_resync();
+}
+
+/*
+ * Checks that native force trim pushes every axis of dev the same way as
+ * trim in force-feedback.nas, through the spring centre or the force
+ * offset, whichever the device uses.
+ */
+bool check_trim(hapticDevice * dev)
+{
+	bool spring = !dev->remote && (dev->effectId[SPRING] != -1 || dev->closed_loop);
+	bool ok = true;
+
+	for (int k = 0; k < AXES; k++) {
+		float trim[AXES] = { 0.0, 0.0, 0.0 };
+		// update_forces() in force-feedback.nas, trim alone at zero deflection
+		float nasal[AXES] = { -sin(0.1), -sin(0.1), sin(0.1) };
+
+		trim[k] = 0.5;
+		for (int a = 0; a < dev->axes && a < AXES; a++) {
+			float want = dev->mix[a][k] * nasal[k];
+			float got = spring ? trim_center(dev, trim, a) : dev->mix[a][k] * trim_sign[k] * trim[k];
+
+			if (dev->stick_axes[a] == k && (want > 0.0) != (got > 0.0)) {
+				printf("   Force trim of %s pushes axis %d the wrong way\n", k == 0 ? "aileron" :
+				       k == 1 ? "elevator" : "rudder", a);
+				ok = false;
+			}
+		}
+	}
+	if (ok)
+		printf("   Force trim matches force-feedback.nas on all axes\n");
+	return ok;
 }
 
 void test_effects(void)
@@ -534,6 +4527,7 @@ void test_effects(void)
 
 	for (int i = 0; i < num_devices; i++) {
 		printf("\nTesting device number %d, %s.\n", i + 1, devices[i].name);
+		check_trim(&devices[i]);
 		printf("HOLD FIRMLY TO YOUR JOYSTICK DURING THE TEST!\n\n");
 		if (devices[i].supported & SDL_HAPTIC_CONSTANT) {
 			printf("Press [enter] to start constant force test.\n");
@@ -552,18 +4546,7 @@ void test_effects(void)
 					x = y = z = 0.0;
 				}
 
-				if (devices[i].axes > 0 && devices[i].effectId[CONST_X] != -1) {
-					devices[i].effect[CONST_X].constant.level = (signed short)clamp(x, -32760.0, 32760.0);
-					reload_effect(&devices[i], &devices[i].effect[CONST_X], &devices[i].effectId[CONST_X], true);
-				}
-				if (devices[i].axes > 1 && devices[i].effectId[CONST_Y] != -1) {
-					devices[i].effect[CONST_Y].constant.level = (signed short)clamp(y, -32760.0, 32760.0);
-					reload_effect(&devices[i], &devices[i].effect[CONST_Y], &devices[i].effectId[CONST_Y], true);
-				}
-				if (devices[i].axes > 2 && devices[i].effectId[CONST_Z] != -1) {
-					devices[i].effect[CONST_Z].constant.level = (signed short)clamp(z, -32760.0, 32760.0);
-					reload_effect(&devices[i], &devices[i].effect[CONST_Z], &devices[i].effectId[CONST_Z], true);
-				}
+				output_forces(&devices[i], x, y, z, false);
 				SDL_Delay(100);
 			} while (runtime < start + 6500);
 		} else
@@ -588,6 +4571,143 @@ void test_effects(void)
 	printf("\nTest done!\n");
 }
 
+// Characterization benchmark
+#define BENCH_TIME	2000	// Length of each timed run, ms
+#define BENCH_SAMPLES	20000	// Latencies kept per run
+#define BENCH_SLOTS	64	// Most effects probed for
+#define BENCH_LEVEL	0x800	// Force while timing, low enough to hold
+
+int compare_float(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Updates constant effect id back to back for BENCH_TIME ms, alternating
+ * its level so no driver can skip the update. Latency percentiles go to
+ * lat, and the percentage of updates that left a running effect stopped
+ * to stops if the device reports effect status. Returns the calls made.
+ */
+int bench_updates(hapticDevice * dev, int id, SDL_HapticEffect * e, bool running, float *lat, int *stops)
+{
+	static float samples[BENCH_SAMPLES];
+	double freq = SDL_GetPerformanceFrequency() / 1e6;
+	unsigned int start = SDL_GetTicks();
+	int calls = 0, kept = 0, stopped = 0;
+
+	if (running)
+		SDL_HapticRunEffect(dev->device, id, 1);
+	else
+		SDL_HapticStopEffect(dev->device, id);
+
+	while (SDL_GetTicks() - start < BENCH_TIME) {
+		Uint64 t = SDL_GetPerformanceCounter();
+
+		e->constant.level = calls & 1 ? -BENCH_LEVEL : BENCH_LEVEL;
+		if (SDL_HapticUpdateEffect(dev->device, id, e) < 0) {
+			printf("   Update error: %s\n", SDL_GetError());
+			break;
+		}
+		if (kept < BENCH_SAMPLES)
+			samples[kept++] = (SDL_GetPerformanceCounter() - t) / freq;
+		if (running && (dev->supported & SDL_HAPTIC_STATUS) && SDL_HapticGetEffectStatus(dev->device, id) == 0) {
+			stopped++;
+			SDL_HapticRunEffect(dev->device, id, 1);
+		}
+		calls++;
+	}
+	SDL_HapticStopEffect(dev->device, id);
+
+	memset(lat, 0, 4 * sizeof(float));
+	if (kept > 0) {
+		qsort(samples, kept, sizeof(float), compare_float);
+		lat[0] = samples[kept / 2];
+		lat[1] = samples[kept * 95 / 100];
+		lat[2] = samples[kept * 99 / 100];
+		lat[3] = samples[kept - 1];
+	}
+	if (stops)
+		*stops = !(dev->supported & SDL_HAPTIC_STATUS) ? -1 : calls ? stopped * 100 / calls : 0;
+	return calls;
+}
+
+/*
+ * Measures how many effects a device takes, and how fast and steadily it
+ * takes constant force updates while the effect plays and while stopped.
+ * Results are saved in the device profile, where fg-haptic uses the slot
+ * count and limits updates to the sustained rate.
+ */
+void bench_device(hapticDevice * dev)
+{
+	benchResults *b = &dev->bench;
+	SDL_HapticEffect e;
+	int ids[BENCH_SLOTS], n = 0, calls;
+
+	printf("\nBenchmarking device %d, %s\n", dev->num, dev->name);
+	if (dev->remote || !(dev->supported & SDL_HAPTIC_CONSTANT)) {
+		printf("   Skipped: No constant force\n");
+		return;
+	}
+
+	// The device is all ours meanwhile
+	for (int x = 0; x < EFFECTS; x++) {
+		if (dev->effectId[x] != -1)
+			SDL_HapticDestroyEffect(dev->device, dev->effectId[x]);
+		dev->effectId[x] = -1;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.type = SDL_HAPTIC_CONSTANT;
+	e.constant.direction.type = SDL_HAPTIC_CARTESIAN;
+	e.constant.direction.dir[0] = 0x1000;
+	e.constant.length = SDL_HAPTIC_INFINITY;
+
+	while (n < BENCH_SLOTS && (ids[n] = SDL_HapticNewEffect(dev->device, &e)) >= 0)
+		n++;
+	for (int k = 1; k < n; k++)
+		SDL_HapticDestroyEffect(dev->device, ids[k]);
+	printf("   Effect slots: %d, driver reports %u\n", n, dev->numEffects);
+	if (n == 0) {
+		printf("   Constant force not accepted: %s\n", SDL_GetError());
+		create_device_effects(dev);
+		return;
+	}
+
+	calls = bench_updates(dev, ids[0], &e, true, b->running, &b->stops);
+	bench_updates(dev, ids[0], &e, false, b->stopped, NULL);
+	SDL_HapticDestroyEffect(dev->device, ids[0]);
+
+	b->rate = calls * 1000.0 / BENCH_TIME;
+	b->slots = n;
+	printf("   Sustained update rate: %.0f/s\n", b->rate);
+	printf("   Update latency, us      median   95%%    99%%    max\n");
+	printf("      playing            %7.0f %7.0f %7.0f %7.0f\n", b->running[0], b->running[1], b->running[2], b->running[3]);
+	printf("      stopped            %7.0f %7.0f %7.0f %7.0f\n", b->stopped[0], b->stopped[1], b->stopped[2], b->stopped[3]);
+	if (b->stops < 0)
+		printf("   Effect status not reported, can't tell if updates interrupt playing\n");
+	else
+		printf("   Updates stopped a playing effect %d%% of the time\n", b->stops);
+	if (b->rate < 1000.0 / LOOP_PERIOD)
+		printf("   Slower than the update loop, constant forces will be sent at %.0f/s\n", b->rate);
+
+	save_profile(dev, NULL);
+	create_device_effects(dev);
+}
+
+void bench_effects(void)
+{
+	printf("\nBenchmark sends small, rapidly alternating forces to each device.\n");
+	printf("HOLD FIRMLY TO YOUR JOYSTICK DURING THE BENCHMARK!\n");
+	if (!profile_dir[0])
+		printf("Profiles are off, results won't be saved\n");
+
+	for (int i = 0; i < num_devices; i++)
+		bench_device(&devices[i]);
+
+	printf("\nBenchmark done!\n");
+}
+
 /**
  * @brief The entry point of this force feedback demo.
  * @param[in] argc Number of arguments.
@@ -595,13 +4715,15 @@ void test_effects(void)
  */
 int main(int argc, char **argv)
 {
-	int i = 0;
 	char *name = NULL;
 	struct sigaction signal_handler;
-	effectParams *oldParams = NULL;
+	effectParams oldParams;
 	unsigned int runtime = 0;
 	unsigned int dt = 0;
 	bool test_mode = false;
+	bool bench_mode = false;
+	bool no_profiles = false;
+	const char *protocol_file = "ff-protocol.xml";
 
 	// Handlers for ctrl+c etc quitting methods
 	signal_handler.sa_handler = abort_execution;
@@ -610,25 +4732,116 @@ int main(int argc, char **argv)
 	sigaction(SIGINT, &signal_handler, NULL);
 	sigaction(SIGQUIT, &signal_handler, NULL);
 
+	// Broken connections are handled where send fails
+	signal_handler.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &signal_handler, NULL);
+
 	printf("fg-haptic version 0.5\n");
 	printf("Force feedback support for Flight Gear\n");
 	printf("Copyright 2011, 2014 Lauri Peltonen, released under GPLv2 or later\n\n");
 
-	if (argc > 1) {
-		name = argv[1];
+	for (int a = 1; a < argc; a++) {
+		name = argv[a];
 		if ((strcmp(name, "--help") == 0) || (strcmp(name, "-h") == 0)) {
 			printf("USAGE: %s [optional parameters]\n"
 			       "    -h or --help : Show this help\n"
-			       "    -t or --test : Test force feedback effects\n\n"
+			       "    -t or --test : Test force feedback effects\n"
+			       "    --benchmark : Measure update rate, latency and slots of each device\n"
+			       "                  and save them in its profile\n"
+			       "    -i or --instance generic-port:telnet-host:telnet-port[:device,...]\n"
+			       "                 : Add a FlightGear instance driving the listed devices,\n"
+			       "                   or all devices not listed elsewhere. May be repeated.\n"
+			       "    --remote-server port[/udp|/tcp]\n"
+			       "                 : Drive local devices with forces from a remote fg-haptic\n"
+			       "    --remote host:port[/udp|/tcp]\n"
+			       "                 : Send forces to devices of a remote force server\n"
+			       "    --profiles dir : Keep device profiles in dir, default ~/.fg-haptic\n"
+			       "    --no-profiles : Don't load or save device profiles\n"
+			       "    --protocol file : Generic protocol used by FlightGear, default ff-protocol.xml\n"
+			       "    --nasal-logic : Leave trim, stick shaker and pusher to force-feedback.nas\n"
+			       "    --control path : Accept control commands on a local socket at path\n"
+			       "    --realtime : Send forces from a thread with real-time priority\n"
+			       "    --cpu n : Keep the real-time thread on CPU n\n"
+			       "    --stream : Stream forces as custom effects to devices that support them\n"
+			       "    --predict ms : Send forces ahead by ms of flightgear and USB latency\n"
+			       "    --closed-loop : Run spring and damper here, from the stick position\n"
+			       "    --log-level level : Write messages up to error, warn, info (default) or debug\n\n"
 			       "Telnet port for FlightGear is %d and generic\n"
 			       "port is %d. See Readme for details.\n", argv[0], DFLTPORT, DFLTPORT + 1);
 			return 0;
-		}
-		if ((strcmp(name, "--test") == 0) || (strcmp(name, "-t") == 0)) {
+		} else if ((strcmp(name, "--test") == 0) || (strcmp(name, "-t") == 0)) {
 			printf("Test mode enabled.\n");
 			test_mode = true;
+		} else if (strcmp(name, "--benchmark") == 0) {
+			bench_mode = true;
+		} else if (((strcmp(name, "--instance") == 0) || (strcmp(name, "-i") == 0)) && a + 1 < argc) {
+			if (!add_instance(argv[++a])) {
+				printf("Invalid FlightGear instance: %s\n", argv[a]);
+				return 1;
+			}
+		} else if (strcmp(name, "--remote-server") == 0 && a + 1 < argc) {
+			if (!parse_remote(argv[++a], REMOTE_SERVER)) {
+				printf("Invalid force server port: %s\n", argv[a]);
+				return 1;
+			}
+		} else if (strcmp(name, "--profiles") == 0 && a + 1 < argc) {
+			strncpy(profile_dir, argv[++a], PATHLEN - 1);
+			no_profiles = false;
+		} else if (strcmp(name, "--protocol") == 0 && a + 1 < argc) {
+			protocol_file = argv[++a];
+		} else if (strcmp(name, "--control") == 0 && a + 1 < argc) {
+			strncpy(control.path, argv[++a], PATHLEN - 1);
+		} else if (strcmp(name, "--predict") == 0 && a + 1 < argc) {
+			predict_ms = clamp(atof(argv[++a]), 0.0, PREDICT_MAX);
+		} else if (strcmp(name, "--log-level") == 0 && a + 1 < argc) {
+			if (log_level(argv[++a]) < 0) {
+				printf("Invalid log level: %s\n", argv[a]);
+				return 1;
+			}
+			SDL_AtomicSet(&logger.level, log_level(argv[a]));
+		} else if (strcmp(name, "--closed-loop") == 0) {
+			closed_loop = true;
+		} else if (strcmp(name, "--stream") == 0) {
+			stream_output = true;
+		} else if (strcmp(name, "--realtime") == 0) {
+			rt.enabled = true;
+		} else if (strcmp(name, "--cpu") == 0 && a + 1 < argc) {
+			rt.cpu = atoi(argv[++a]);
+		} else if (strcmp(name, "--nasal-logic") == 0) {
+			native_logic = false;
+		} else if (strcmp(name, "--no-profiles") == 0) {
+			no_profiles = true;
+		} else if (strcmp(name, "--remote") == 0 && a + 1 < argc) {
+			if (!parse_remote(argv[++a], REMOTE_CLIENT)) {
+				printf("Invalid force server address: %s\n", argv[a]);
+				return 1;
+			}
+		} else {
+			printf("Unknown parameter %s, see %s --help\n", name, argv[0]);
+			return 1;
 		}
 	}
+
+	// By default a single local flightgear drives all devices
+	if (num_instances == 0 && remote.mode != REMOTE_SERVER) {
+		char spec[NAMELEN * 2];
+		snprintf(spec, sizeof(spec), "%d:%s:%d", DFLTPORT + 1, DFLTHOST, DFLTPORT);
+		add_instance(spec);
+	}
+
+	// Profiles live in the home directory by default
+	if (no_profiles)
+		profile_dir[0] = '\0';
+	else if (!profile_dir[0] && getenv(HOMEVAR))
+		snprintf(profile_dir, PATHLEN, "%s/.fg-haptic", getenv(HOMEVAR));
+
+	// Generic IO layout as FlightGear sends it
+	if (remote.mode != REMOTE_SERVER)
+		load_protocol(protocol_file);
+	native_logic = native_logic && protocol.native;
+
+	init_log();
+
 	// Initialize SDL haptics
 	init_haptic();
 
@@ -639,192 +4852,211 @@ int main(int argc, char **argv)
 		test_effects();
 		abort_execution(0);
 	}
-
-	socketset = SDLNet_AllocSocketSet(2);
-	if (!socketset) {
-		printf("Unable to create socket set: %s\n", SDLNet_GetError());
-		abort_execution(-1);
-	}
-	// Wait for a connection from flightgear generic io
-	printf("\n\nWaiting for flightgear generic IO at port %d, please run Flight Gear now!\n", DFLTPORT + 1);
-	server_sock = fgfsconnect(DFLTHOST, DFLTPORT + 1, true);
-	if (!server_sock) {
-		printf("Failed to connect!\n");
-		abort_execution(-1);
-	}
-
-	printf("Got connection, sending haptic details through telnet at port %d\n", DFLTPORT);
-
-	// Connect to flightgear using telnet
-	telnet_sock = fgfsconnect(DFLTHOST, DFLTPORT, false);
-	if (!telnet_sock) {
-		printf("Could not connect to flightgear with telnet!\n");
-		abort_execution(-1);
+	if (bench_mode) {
+		bench_effects();
+		abort_execution(0);
 	}
-	// Add sockets to a socket set for polling/selecting
-	SDLNet_TCP_AddSocket(socketset, client_sock);
-	SDLNet_TCP_AddSocket(socketset, telnet_sock);
 
-	// Switch to data mode
-	fgfswrite(telnet_sock, "data");
+	init_control();
+	init_realtime();
 
-	// send the devices to flightgear
-	send_devices();
+	// From here on ctrl+c ends the loop, which cleans up on its way out
+	signal_handler.sa_handler = stop_loop;
+	sigaction(SIGINT, &signal_handler, NULL);
+	sigaction(SIGQUIT, &signal_handler, NULL);
 
-	// allocate memory for old param values
-	oldParams = (effectParams *) malloc(num_devices * sizeof(effectParams));
-	if (!oldParams) {
-		printf("Fatal error: Could not allocate memory!\n");
-		abort_execution(-1);
+	if (remote.mode == REMOTE_SERVER) {
+		init_remote();
+		remote_server_loop();
+		printf("\nAborting program execution.\n");
+		cleanup();
+		return 0;
+	} else if (remote.mode == REMOTE_CLIENT) {
+		init_remote();
 	}
 
-	printf("Running...\n");
+	init_instances();
+	printf("\n\nPlease run Flight Gear now!\n");
+	logger.loop = true;
 
 	// Main loop
 
-	while (!quit)		// Loop as long as the connection is alive
+	while (!quit)		// Loop until aborted, flightgear may come and go
 	{
 		dt = runtime;
 		runtime = SDL_GetTicks();	// Run time in ms
 		dt = runtime - dt;
 
-		// Back up old parameters
-		for (int i = 0; i < num_devices; i++)
-			memcpy((void *)&oldParams[i], (void *)&devices[i].params, sizeof(effectParams));
+		// Devices plugged in or out since last round
+		if (handle_events()) {
+			for (int n = 0; n < num_instances; n++)
+				if (instances[n].state == FG_RUNNING)
+					send_devices(&instances[n]);
+			wake_instances();
+		}
 
-		memset((void *)&devices[i].params, 0, sizeof(effectParams));
+		// Remote server devices and latency
+		if (remote.mode == REMOTE_CLIENT)
+			remote_poll(runtime, 0);
+
+		control_poll(runtime);
+		control.loops++;
+		if (dt > control.max_dt)
+			control.max_dt = dt;
+
+		// Read new parameters from every instance, devices of instances
+		// that are not running are held at neutral
+		for (int n = 0; n < num_instances; n++) {
+			update_connection(&instances[n], runtime);
+			if (instances[n].state == FG_RUNNING)
+				read_fg(&instances[n]);
+			update_idle(&instances[n], runtime);
+		}
 
-		// Read new parameters
-		read_fg();
+		// Effects the last round found wrong for the device
+		for (int i = 0; i < num_devices; i++) {
+			if (SDL_AtomicSet(&devices[i].recreate, 0)) {
+				create_device_effects(&devices[i]);
+				devices[i].profile_dirty = true;
+			}
+		}
 
 		// If parameters have changed, apply them
 		for (int i = 0; i < num_devices; i++) {
-			if (!devices[i].device || !devices[i].open)
+			fgInstance *fg = devices[i].fg;
+
+			if ((!devices[i].device && !devices[i].remote) || !devices[i].open)
 				continue;	// Break if device is not opened correctly
+			if (!fg || fg->state != FG_RUNNING || fg_lost(fg))
+				continue;	// Devices are neutralized when the connection is closed
+			if (hold_neutral)
+				continue;	// Neutralized by the control command
+			if (fg->idle && !devices[i].remote)
+				continue;	// Holding the last force
+
+			// Updates can't stop while these play through the loop
+			if (devices[i].closed_loop || (devices[i].software & devices[i].periodic_on)
+			    || ((devices[i].software & (1 << STICK_SHAKER)) && fg->new_params.shaker_trigger))
+				fg->busy = true;
+
+			// Back up old parameters
+			memcpy((void *)&oldParams, (void *)&devices[i].params, sizeof(effectParams));
+			memset((void *)&devices[i].params, 0, sizeof(effectParams));
 
 			// Constant forces (stick forces, pilot G forces
+			float direct[AXES] = { 0.0, 0.0, 0.0 };
 			if ((devices[i].supported & SDL_HAPTIC_CONSTANT)) {
-				// Stick forces with axis mapping
-				if (devices[i].stick_axes[0] >= 0)
-					devices[i].params.x = new_params.stick[devices[i].stick_axes[0]] * devices[i].stick_gain;
-				if (devices[i].stick_axes[1] >= 0)
-					devices[i].params.y = new_params.stick[devices[i].stick_axes[1]] * devices[i].stick_gain;
-				if (devices[i].stick_axes[2] >= 0)
-					devices[i].params.z = new_params.stick[devices[i].stick_axes[2]] * devices[i].stick_gain;
-
-				// Pilot forces
-				if (devices[i].stick_axes[0] >= 0)
-					devices[i].params.x += new_params.stick[devices[i].stick_axes[0]] * devices[i].stick_gain;
-				if (devices[i].pilot_axes[1] >= 0)
-					devices[i].params.y += new_params.pilot[devices[i].pilot_axes[1]] * devices[i].pilot_gain;
-				if (devices[i].pilot_axes[2] >= 0)
-					devices[i].params.z += new_params.pilot[devices[i].pilot_axes[2]] * devices[i].pilot_gain;
-
-				devices[i].params.x *= 32760.0;
-				devices[i].params.y *= 32760.0;
-				devices[i].params.z *= 32760.0;
+				// Stick and pilot forces through the mixing matrix
+				float src[SOURCES], out[AXES];
+
+				memcpy(&src[0], fg->new_params.stick, sizeof(fg->new_params.stick));
+				memcpy(&src[AXES], fg->new_params.pilot, sizeof(fg->new_params.pilot));
+				if (predict_ms > 0.0)
+					predict_forces(fg, &devices[i], runtime, src);
+
+				// Force trim moves the spring centre, or the force if there is no spring
+				if (native_logic && !devices[i].closed_loop && !output_trim(&devices[i], fg->new_params.trim))
+					for (int k = 0; k < AXES; k++)
+						src[k] += trim_sign[k] * fg->new_params.trim[k] * devices[i].spring_gain
+						    * clamp(fg->new_params.control_loading, 0.0, 1.0);
+				synth_forces(&devices[i], &fg->new_params, fg->turbulence, dt, &src[FILTERED_SOURCES]);
+				for (int k = FILTERED_SOURCES; k < SOURCES; k++)
+					if (src[k] != 0.0)
+						fg->busy = true;
+				for (int a = 0; a < AXES; a++) {
+					out[a] = 0.0;
+					for (int k = 0; k < FILTERED_SOURCES; k++)
+						out[a] += devices[i].mix[a][k] * src[k];
+					for (int k = FILTERED_SOURCES; k < SOURCES; k++)
+						direct[a] += devices[i].mix[a][k] * src[k];
+				}
+				if (devices[i].closed_loop) {
+					float loop[AXES];
+
+					closed_loop_forces(&devices[i], &fg->new_params, dt, loop);
+					for (int a = 0; a < AXES; a++)
+						direct[a] += loop[a];
+				}
+				devices[i].params.x = out[0];
+				devices[i].params.y = out[1];
+				devices[i].params.z = out[2];
 
 				// Low pass filter
 				float g1 = ((float)dt / (devices[i].lowpass + dt));
 				float g2 = (devices[i].lowpass / (devices[i].lowpass + dt));
-				devices[i].params.x = devices[i].params.x * g1 + oldParams[i].x * g2;
-				devices[i].params.y = devices[i].params.y * g1 + oldParams[i].y * g2;
-				devices[i].params.z = devices[i].params.z * g1 + oldParams[i].z * g2;
-
-				// Add ground rumble
-				float rumble = 0.0;
-				if (new_params.rumble_period > 0.00001) {
-					if ((runtime - devices[i].last_rumble) > new_params.rumble_period) {
-						rumble = devices[i].rumble_gain * 32760.0;
-						devices[i].last_rumble = runtime;
-					}
-				}
-
-				if (devices[i].axes > 0 && devices[i].effectId[CONST_X] != -1) {
-					devices[i].effect[CONST_X].constant.level =
-					    (signed short)clamp(devices[i].params.x, -32760.0, 32760.0);
-					reload_effect(&devices[i], &devices[i].effect[CONST_X], &devices[i].effectId[CONST_X], true);
-				}
-				if (devices[i].axes > 1 && devices[i].effectId[CONST_Y] != -1) {
-					devices[i].effect[CONST_Y].constant.level =
-					    (signed short)clamp(devices[i].params.y + rumble, -32760.0, 32760.0);
-					reload_effect(&devices[i], &devices[i].effect[CONST_Y], &devices[i].effectId[CONST_Y], true);
-				}
-				if (devices[i].axes > 2 && devices[i].effectId[CONST_Z] != -1) {
-					devices[i].effect[CONST_Z].constant.level =
-					    (signed short)clamp(devices[i].params.z, -32760.0, 32760.0);;
-					reload_effect(&devices[i], &devices[i].effect[CONST_Z], &devices[i].effectId[CONST_Z], true);
-				}
+				devices[i].params.x = devices[i].params.x * g1 + oldParams.x * g2;
+				devices[i].params.y = devices[i].params.y * g1 + oldParams.y * g2;
+				devices[i].params.z = devices[i].params.z * g1 + oldParams.z * g2;
 				// printf("dt: %d  X: %.6f  Y: %.6f\n", (unsigned int)dt, devices[i].params.x, devices[i].params.y);
 			}
-			// Stick shaker trigger
-			if ((devices[i].supported & SDL_HAPTIC_SINE) && devices[i].effectId[STICK_SHAKER] != -1) {
-				if (new_params.shaker_trigger && !oldParams[i].shaker_trigger)
-					reload_effect(&devices[i], &devices[i].effect[STICK_SHAKER], &devices[i].effectId[STICK_SHAKER],
-						      true);
-				else if (!new_params.shaker_trigger && oldParams[i].shaker_trigger)
-					SDL_HapticStopEffect(devices[i].device, devices[i].effectId[STICK_SHAKER]);
-			}
-		}
 
-		if (reconf_request) {
-			reconf_request = false;
-			read_devices();
-			create_effects();
+			// Vibration and the closed loop skip the filter, it would smooth away
+			// the one and make the other lag
+			send_forces(&devices[i], devices[i].params.x + direct[0], devices[i].params.y + direct[1],
+				    devices[i].params.z + direct[2], fg->new_params.shaker_trigger);
+
+			if (has_periodic(&devices[i], GROUND_RUMBLE))
+				output_periodic(&devices[i], GROUND_RUMBLE, fg->new_params.rumble_period,
+						devices[i].rumble_gain * 32760.0);
+			if (has_periodic(&devices[i], ENGINE_VIBRATION))
+				output_periodic(&devices[i], ENGINE_VIBRATION, fg->new_params.engine_period,
+						devices[i].engine_gain * fg->new_params.engine_level * 32760.0);
+
+			// Control loading, stiffness follows dynamic pressure
+			float loading = clamp(fg->new_params.control_loading, 0.0, 1.0);
+			if (has_condition(&devices[i], SPRING))
+				output_condition(&devices[i], SPRING, devices[i].spring_gain * loading * 32767.0);
+			if (has_condition(&devices[i], DAMPER))
+				output_condition(&devices[i], DAMPER, devices[i].damper_gain * loading * 32767.0);
+			if (has_condition(&devices[i], FRICTION))
+				output_condition(&devices[i], FRICTION, devices[i].friction_gain * 32767.0);
 		}
 
-		SDL_Delay(10);
+		for (int n = 0; n < num_instances; n++)
+			update_reconfigure(&instances[n], runtime);
+
+		// Slow down while no instance needs updates
+		bool idle = true;
+		for (int n = 0; n < num_instances; n++)
+			if (instances[n].state == FG_RUNNING && !instances[n].idle)
+				idle = false;
+		if (idle)
+			idle_wait();
+		else if (output.thread)
+			SDL_Delay(LOOP_PERIOD);	// Deadlines are kept by the output thread
+		else
+			rt_wait();
 	}
 
-	// Close flightgear telnet connection
-	fgfswrite(telnet_sock, "quit");
-	fgfsclose(telnet_sock);
-
-	// Close generic connection
-	fgfsclose(client_sock);
-	fgfsclose(server_sock);
-
-	SDLNet_FreeSocketSet(socketset);
-
-	if (oldParams)
-		free(oldParams);
-	oldParams = NULL;
-
-	// Close haptic devices
-	for (int i = 0; i < num_devices; i++)
-		if ( /*devices[i].open && */ devices[i].device)
-			SDL_HapticClose(devices[i].device);
-
-	if (devices)
-		free(devices);
-	devices = NULL;
-
-	SDL_Quit();
+	printf("\nAborting program execution.\n");
+	cleanup();
 
 	return 0;
 }
 
 /*
- * Cleans up a bit.
+ * Ends the loop on ctrl+c.
  */
-void abort_execution(int signal)
+void stop_loop(int signal)
 {
-	printf("\nAborting program execution.\n");
-
-	// Close flightgear telnet connection
-	fgfswrite(telnet_sock, "quit");
-	fgfsclose(telnet_sock);
-
-	// Adn generic
-	fgfsclose(client_sock);
-	fgfsclose(server_sock);
+	quit = 1;
+}
 
-	SDLNet_FreeSocketSet(socketset);
+/*
+ * Closes connections and devices and shuts down SDL.
+ */
+void cleanup(void)
+{
+	// Close flightgear connections
+	for (int n = 0; n < num_instances; n++)
+		close_instance(&instances[n]);
+	close_remote();
+	close_control();
+	close_realtime();
 
 	// Close haptic devices
-	for (int i = 0; i < num_devices; i++)
-		if (devices[i].open && devices[i].device)
-			SDL_HapticClose(devices[i].device);
+	while (num_devices > 0)
+		close_device(num_devices - 1);
 
 	if (devices)
 		free(devices);
@@ -832,187 +5064,319 @@ void abort_execution(int signal)
 
 	SDLNet_Quit();
 
+	close_log();
 	SDL_Quit();
+}
 
+/*
+ * Cleans up a bit, for errors and ctrl+c before the loop runs.
+ */
+void abort_execution(int signal)
+{
+	printf("\nAborting program execution.\n");
+	cleanup();
 	exit(1);
 }
 
 /*
  * Displays information about the haptic device.
  */
-void HapticPrintSupported(SDL_Haptic * haptic)
+void HapticPrintSupported(hapticDevice * dev)
 {
-	unsigned int supported;
+	unsigned int supported = dev->supported;
 
-	supported = SDL_HapticQuery(haptic);
-	printf("   Device has %d axis\n", SDL_HapticNumAxes(haptic));
-	printf("   Supported effects [%d effects, %d playing]:\n", SDL_HapticNumEffects(haptic), SDL_HapticNumEffectsPlaying(haptic));
+	device_print(dev, "   Device has %d axis\n", dev->axes);
+	device_print(dev, "   Supported effects [%d effects, %d playing]:\n", dev->numEffects, dev->numEffectsPlaying);
 	if (supported & SDL_HAPTIC_CONSTANT)
-		printf("      constant\n");
+		device_print(dev, "      constant\n");
 	if (supported & SDL_HAPTIC_SINE)
-		printf("      sine\n");
+		device_print(dev, "      sine\n");
 /*    if (supported & SDL_HAPTIC_SQUARE)
-        printf("      square\n");*/
+        device_print(dev, "      square\n");*/
 	if (supported & SDL_HAPTIC_TRIANGLE)
-		printf("      triangle\n");
+		device_print(dev, "      triangle\n");
 	if (supported & SDL_HAPTIC_SAWTOOTHUP)
-		printf("      sawtoothup\n");
+		device_print(dev, "      sawtoothup\n");
 	if (supported & SDL_HAPTIC_SAWTOOTHDOWN)
-		printf("      sawtoothdown\n");
+		device_print(dev, "      sawtoothdown\n");
 	if (supported & SDL_HAPTIC_RAMP)
-		printf("      ramp\n");
+		device_print(dev, "      ramp\n");
 	if (supported & SDL_HAPTIC_FRICTION)
-		printf("      friction\n");
+		device_print(dev, "      friction\n");
 	if (supported & SDL_HAPTIC_SPRING)
-		printf("      spring\n");
+		device_print(dev, "      spring\n");
 	if (supported & SDL_HAPTIC_DAMPER)
-		printf("      damper\n");
+		device_print(dev, "      damper\n");
 	if (supported & SDL_HAPTIC_INERTIA)
-		printf("      intertia\n");
+		device_print(dev, "      intertia\n");
 	if (supported & SDL_HAPTIC_CUSTOM)
-		printf("      custom\n");
-	printf("   Supported capabilities:\n");
+		device_print(dev, "      custom\n");
+	device_print(dev, "   Supported capabilities:\n");
 	if (supported & SDL_HAPTIC_GAIN)
-		printf("      gain\n");
+		device_print(dev, "      gain\n");
 	if (supported & SDL_HAPTIC_AUTOCENTER)
-		printf("      autocenter\n");
+		device_print(dev, "      autocenter\n");
 	if (supported & SDL_HAPTIC_STATUS)
-		printf("      status\n");
+		device_print(dev, "      status\n");
+}
+
+/*
+ * Starts using sock as connection c. Returns FGFS_OK, or FGFS_CLOSED if
+ * sock is NULL or can't be waited on.
+ */
+int fgfsopen(fgConn * c, TCPsocket sock)
+{
+	memset(c, 0, sizeof(fgConn));
+	if (!sock)
+		return FGFS_CLOSED;
+
+	c->set = SDLNet_AllocSocketSet(1);
+	if (!c->set) {
+		log_msg(LOG_ERROR, "Error in fgfsopen: %s", SDLNet_GetError());
+		SDLNet_TCP_Close(sock);
+		return FGFS_CLOSED;
+	}
+	SDLNet_TCP_AddSocket(c->set, sock);
+	c->sock = sock;
+	return FGFS_OK;
+}
+
+void fgfsclose(fgConn * c)
+{
+	if (c->sock)
+		SDLNet_TCP_Close(c->sock);
+	if (c->set)
+		SDLNet_FreeSocketSet(c->set);
+	c->sock = NULL;
+	c->set = NULL;
+	c->inlen = c->outlen = 0;
+	c->batch = false;
 }
 
-int fgfswrite(TCPsocket sock, char *msg, ...)
+/*
+ * Formats a telnet command into the output buffer of c. Outside a batch
+ * it is sent right away. Returns the length or a negative FGFS_ error.
+ */
+int fgfswrite(fgConn * c, char *msg, ...)
 {
 	va_list va;
-	ssize_t len;
-	char buf[MAXMSG];
+	int len;
 
-	if (!sock)
+	if (!c->sock)
 		return 0;
+	if (c->error)
+		return c->error;
+
+	if (c->outlen > OUTBUF - MAXMSG && fgfssend(c) < 0)
+		return c->error;
 
 	va_start(va, msg);
-	vsnprintf(buf, MAXMSG - 2, msg, va);
+	len = vsnprintf(&c->out[c->outlen], MAXMSG - 2, msg, va);
 	va_end(va);
-	//printf("SEND: \t<%s>\n", buf);
-	strcat(buf, "\r\n");
+	if (len > MAXMSG - 3)
+		len = MAXMSG - 3;	// Truncated like before
+	//printf("SEND: \t<%s>\n", &c->out[c->outlen]);
+	memcpy(&c->out[c->outlen + len], "\r\n", 2);
+	c->outlen += len + 2;
+
+	if (!c->batch)
+		return fgfssend(c);
+	return len + 2;
+}
+
+/*
+ * Starts collecting telnet commands, they are sent by fgfspush().
+ */
+void fgfsbatch(fgConn * c)
+{
+	c->batch = true;
+}
+
+/*
+ * Ends a batch, sending the collected telnet commands.
+ */
+int fgfspush(fgConn * c)
+{
+	c->batch = false;
+	return fgfssend(c);
+}
+
+/*
+ * Sends the output buffer with a single send.
+ */
+int fgfssend(fgConn * c)
+{
+	int len = c->outlen;
+
+	c->outlen = 0;
+	if (len == 0 || !c->sock || c->error)
+		return c->error;
 
-	len = SDLNet_TCP_Send(sock, buf, strlen(buf));
-	if (len < 0) {
-		printf("Error in fgfswrite: %s\n", SDLNet_GetError());
-		exit(EXIT_FAILURE);
+	if (SDLNet_TCP_Send(c->sock, c->out, len) < len) {
+		log_msg(LOG_ERROR, "Error in fgfswrite: %s", SDLNet_GetError());
+		c->error = FGFS_CLOSED;
+		return c->error;
 	}
 	return len;
 }
 
-const char *fgfsread(TCPsocket sock, int timeout)
+/*
+ * Returns the next line received on c without line end, waiting at most
+ * timeout seconds for it. The line stays valid until the next call.
+ * Returns NULL on timeout, empty lines and errors, errors are left in
+ * c->error.
+ */
+const char *fgfsread(fgConn * c, int timeout)
 {
-	static char buf[MAXMSG];
-	char *p = &buf[0];
-	size_t len = 0;
-	int ready = 0;
-	time_t start;
+	unsigned int start = SDL_GetTicks();
+	char *nl = NULL;
+	int len, wait;
 
-	memset(buf, 0, MAXMSG);
+	if (!c->sock || c->error)
+		return NULL;
 
-	start = clock();
-	do {
-		ready = SDLNet_CheckSockets(socketset, timeout * 1000);
-		if (!ready) {
-			//printf("Timeout!\n");
+	// Data is received in chunks, keep whatever follows the line for later
+	while (!(nl = memchr(c->in, '\n', c->inlen)) && c->inlen < MAXMSG - 1) {
+		wait = timeout * 1000 - (int)(SDL_GetTicks() - start);
+		if (SDLNet_CheckSockets(c->set, wait > 0 ? wait : 0) <= 0)
+			return NULL;	// Timeout
+
+		len = SDLNet_TCP_Recv(c->sock, &c->in[c->inlen], MAXMSG - 1 - c->inlen);
+		if (len <= 0) {
+			// printf("Error in fgfsread: Recv returned zero!\n");
+			c->error = FGFS_CLOSED;
 			return NULL;
 		}
-		SDL_Delay(5);
+		c->inlen += len;
+	}
 
-		// TODO: Loop until socket is ready or timeout?
-		if (SDLNet_SocketReady(sock)) {
-			ready = 1;
-		}
-	} while (!ready && clock() < (start + timeout * CLOCKS_PER_SEC));
+	if (nl) {
+		len = nl - c->in + 1;
+	} else {
+		log_msg(LOG_WARN, "Warning in fgfsread: Buffer size exceeded!");
+		len = c->inlen;
+	}
+	memcpy(c->line, c->in, len);
+	c->inlen -= len;
+	memmove(c->in, &c->in[len], c->inlen);
+
+	while (len > 0 && (c->line[len - 1] == '\r' || c->line[len - 1] == '\n'))
+		len--;
+	c->line[len] = '\0';
 
-	if (!ready) {
-		//printf("Error in fgfsread: Socket was not ready (timeout)!\n");
+	// if(len) printf("RECV: %s\n", c->line);
+
+	return len ? c->line : NULL;
+}
+
+/*
+ * Returns the next line received on c without waiting, or NULL if it
+ * hasn't fully arrived yet. Unlike fgfsread() empty lines are returned,
+ * as flightgear replies to gets of unset properties with them.
+ */
+const char *fgfsreply(fgConn * c)
+{
+	char *nl;
+	int len;
+
+	if (!c->sock || c->error)
 		return NULL;
-	}
 
-	ready = 0;
-	do {
-		if (SDLNet_TCP_Recv(sock, p, 1) <= 0) {
-			// printf("Error in fgfsread: Recv returned zero!\n");
-			quit = true;
+	while (!(nl = memchr(c->in, '\n', c->inlen)) && c->inlen < MAXMSG - 1
+	       && SDLNet_CheckSockets(c->set, 0) > 0) {
+		len = SDLNet_TCP_Recv(c->sock, &c->in[c->inlen], MAXMSG - 1 - c->inlen);
+		if (len <= 0) {
+			c->error = FGFS_CLOSED;
 			return NULL;
 		}
-		len++;
-		if (len == MAXMSG - 1) {
-			printf("Warning in fgfsread: Buffer size exceeded!\n");
-			ready = 1;
-		} else if (*p == '\n') {
-			ready = 1;
-		}
-		p++;
-	} while (!ready);
+		c->inlen += len;
+	}
+	if (!nl && c->inlen < MAXMSG - 1)
+		return NULL;	// Not yet
 
-	for (p = &buf[len - 1]; p >= buf; p--)
-		if (*p != '\r' && *p != '\n')
-			break;
-	*++p = '\0';
+	// Takes the line out like a read, which leaves empty lines in c->line too
+	fgfsread(c, 0);
+	return c->line;
+}
+
+/*
+ * Returns the next len bytes received on c, waiting at most timeout
+ * seconds for them. Used for binary generic IO records.
+ */
+const char *fgfsreadrecord(fgConn * c, int len, int timeout)
+{
+	unsigned int start = SDL_GetTicks();
+	int got, wait;
+
+	if (!c->sock || c->error || len > MAXMSG - 1)
+		return NULL;
 
-	// if(strlen(buf)) printf("RECV: %s\n", buf);
+	while (c->inlen < len) {
+		wait = timeout * 1000 - (int)(SDL_GetTicks() - start);
+		if (SDLNet_CheckSockets(c->set, wait > 0 ? wait : 0) <= 0)
+			return NULL;	// Timeout
+
+		got = SDLNet_TCP_Recv(c->sock, &c->in[c->inlen], MAXMSG - 1 - c->inlen);
+		if (got <= 0) {
+			c->error = FGFS_CLOSED;
+			return NULL;
+		}
+		c->inlen += got;
+	}
 
-	return strlen(buf) ? buf : NULL;
+	memcpy(c->line, c->in, len);
+	c->inlen -= len;
+	memmove(c->in, &c->in[len], c->inlen);
+	return c->line;
 }
 
-void fgfsflush(TCPsocket sock)
+/*
+ * Throws away everything received so far.
+ */
+void fgfsflush(fgConn * c)
 {
-	const char *p;
-	while ((p = fgfsread(sock, 0)) != NULL) {
-		//printf("IGNORE: \t<%s>\n", p);
+	int len;
+
+	c->inlen = 0;
+	while (c->sock && !c->error && SDLNet_CheckSockets(c->set, 0) > 0) {
+		len = SDLNet_TCP_Recv(c->sock, c->in, MAXMSG - 1);
+		if (len <= 0)
+			c->error = FGFS_CLOSED;
 	}
+	//printf("IGNORE: \t<%s>\n", p);
 }
 
 TCPsocket fgfsconnect(const char *hostname, const int port, bool server)
 {
 	IPaddress serv_addr, cli_addr;
-	TCPsocket _sock, _clientsock;
-	time_t start;
+	TCPsocket _sock;
 
 	if (!server)		// Act as a client -> connect to address
 	{
 		if (SDLNet_ResolveHost(&cli_addr, hostname, port) == -1) {
-			printf("Error in fgfsconnect, resolve host: %s\n", SDLNet_GetError());
+			log_msg(LOG_WARN, "Error in fgfsconnect, resolve host: %s", SDLNet_GetError());
 			return NULL;
 		}
 
 		_sock = SDLNet_TCP_Open(&cli_addr);
 		if (!_sock) {
-			printf("Error in fgfsconnect, connect: %s\n", SDLNet_GetError());
+			log_msg(LOG_WARN, "Error in fgfsconnect, connect: %s", SDLNet_GetError());
 			return NULL;
 		}
 
 		return _sock;
 
-	} else {		// Act as a server, wait for connections
+	} else {		// Act as a server, connections are accepted in update_connection()
 		if (SDLNet_ResolveHost(&serv_addr, NULL, port) == -1) {
-			printf("Error in fgfsconnect, server resolve host: %s\n", SDLNet_GetError());
+			log_msg(LOG_ERROR, "Error in fgfsconnect, server resolve host: %s", SDLNet_GetError());
 			return NULL;
 		}
 
 		_sock = SDLNet_TCP_Open(&serv_addr);
 		if (!_sock) {
-			printf("Error in fgfsconnect, server connect: %s\n", SDLNet_GetError());
+			log_msg(LOG_ERROR, "Error in fgfsconnect, server connect: %s", SDLNet_GetError());
 			return NULL;
 		}
-		// Wait for connection until timeout
-		start = clock();
-		do {
-			SDL_Delay(50);
-			_clientsock = SDLNet_TCP_Accept(_sock);
-		} while (!_clientsock && clock() < (start + CONN_TIMEOUT * CLOCKS_PER_SEC));
-
-		if (!_clientsock) {
-			printf("Error in fgfsconnect: Connection timeout\n");
-			return NULL;
-		}
-
-		client_sock = _clientsock;
 
 		return _sock;
 	}